@@ -0,0 +1,593 @@
+/* End-to-end benchmark of beam_search_batch and kenlm_scores_batch, the
+ * torch-free core behind lm_decoder.beam_search / get_kenlm_scores.
+ * Modeled on KenLM's lm/kenlm_benchmark_main.cc.
+ *
+ * The language model is either given with --lm (ARPA or binary), generated
+ * (--synthetic-vocab N: Zipf sentences over N words, every n-gram of them
+ * kept), or KenLM's bundled lm/test.arpa. ARPA models are compiled to a
+ * temporary probing binary first, which is what the decoder loads.
+ * Batches are synthetic: short_list candidates per step drawn from a Zipf
+ * distribution over the MT vocabulary (the LM words plus a few OOVs), with
+ * decreasing TM probabilities and random gates.
+ *
+ * With --restrict-vocab N the MT vocabulary only keeps N of the LM words and
+ * the decoder loads the ARPA model restricted to them, through the binary
+ * cache in --binary-cache DIR. It reports the size reduction and checks the
+ * LM scores of the batches against the full model first.
+ *
+ * For every worker count it reports sentences/s and tokens/s of whole
+ * batches, the p50 / p99 latency of one sentence, and the speedup over the
+ * first worker count.
+ *
+ * build: make -C benchmark -j8  (no torch needed, writes build/decoder_benchmark; or python setup.py build_benchmark)
+ * run:   ./build/decoder_benchmark --workers 1,2,4,8 --batch 64 --length 30 --length-dist lognormal
+ */
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <numeric>
+#include <random>
+#include <set>
+#include <sstream>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+#include "lm/binary_format.hh"
+#include "lm/config.hh"
+#include "lm/model.hh"
+#include "beam_search.h"
+#include "kenlm_scorer.h"
+#include "tensor_view.h"
+#include "worker_pool.h"
+
+namespace {
+
+struct Options
+{
+  std::string lm = "third_party/kenlm/lm/test.arpa";
+  int synthetic_vocab = 0;
+  int synthetic_sentences = 20000;
+  int order = 4;
+  int batch = 64;
+  int batches = 20;
+  int length = 30;
+  std::string length_dist = "lognormal";  // fixed, uniform or lognormal around length
+  int max_length = 200;
+  int short_list = 30;
+  int beam = 5;
+  std::string type = "moe";
+  float prune_margin = -1;  // < 0: score every candidate
+  std::vector<int> workers = {1, 2, 4, 8};
+  int cache = 16384;
+  double oov_rate = 0.02;
+  int seed = 1;
+  int restrict_vocab = 0;    // > 0: LM words kept in the MT vocabulary, and n-grams of them in the LM
+  std::string binary_cache;  // where the restricted binaries are kept
+};
+
+void usage(const char *name)
+{
+  fprintf(stderr,
+          "usage: %s [--lm FILE | --synthetic-vocab N [--synthetic-sentences N] [--order N]]\n"
+          "          [--batch N] [--batches N] [--length N] [--length-dist fixed|uniform|lognormal]\n"
+          "          [--max-length N] [--short-list N] [--beam N] [--type moe|shallow|simple]\n"
+          "          [--prune-margin M] [--workers 1,2,4,8] [--cache ENTRIES] [--oov-rate R] [--seed N]\n"
+          "          [--restrict-vocab N --binary-cache DIR]\n",
+          name);
+  exit(1);
+}
+
+Options parse(int argc, char *argv[])
+{
+  Options options;
+  for (int i = 1; i < argc; i++)
+  {
+    std::string key = argv[i];
+    if (i + 1 >= argc)
+    {
+      usage(argv[0]);
+    }
+    std::string value = argv[++i];
+    if (key == "--lm") options.lm = value;
+    else if (key == "--synthetic-vocab") options.synthetic_vocab = atoi(value.c_str());
+    else if (key == "--synthetic-sentences") options.synthetic_sentences = atoi(value.c_str());
+    else if (key == "--order") options.order = atoi(value.c_str());
+    else if (key == "--batch") options.batch = atoi(value.c_str());
+    else if (key == "--batches") options.batches = atoi(value.c_str());
+    else if (key == "--length") options.length = atoi(value.c_str());
+    else if (key == "--length-dist") options.length_dist = value;
+    else if (key == "--max-length") options.max_length = atoi(value.c_str());
+    else if (key == "--short-list") options.short_list = atoi(value.c_str());
+    else if (key == "--beam") options.beam = atoi(value.c_str());
+    else if (key == "--type") options.type = value;
+    else if (key == "--prune-margin") options.prune_margin = atof(value.c_str());
+    else if (key == "--cache") options.cache = atoi(value.c_str());
+    else if (key == "--oov-rate") options.oov_rate = atof(value.c_str());
+    else if (key == "--seed") options.seed = atoi(value.c_str());
+    else if (key == "--restrict-vocab") options.restrict_vocab = atoi(value.c_str());
+    else if (key == "--binary-cache") options.binary_cache = value;
+    else if (key == "--workers")
+    {
+      options.workers.clear();
+      std::stringstream stream(value);
+      std::string item;
+      while (std::getline(stream, item, ','))
+      {
+        options.workers.push_back(atoi(item.c_str()));
+      }
+    }
+    else usage(argv[0]);
+  }
+  if (options.beam > options.short_list || options.workers.empty() || options.order < 2 ||
+      options.order > KENLM_MAX_ORDER || (options.restrict_vocab > 0 && options.binary_cache.empty()))
+  {
+    usage(argv[0]);
+  }
+  return options;
+}
+
+std::string temp_path(const char *suffix)
+{
+  char name[] = "/tmp/decoder_benchmark.XXXXXX";
+  int fd = mkstemp(name);
+  if (fd < 0)
+  {
+    perror("mkstemp");
+    exit(1);
+  }
+  close(fd);
+  unlink(name);
+  return std::string(name) + suffix;
+}
+
+// weights 1 / (rank + 1)
+std::discrete_distribution<int> zipf(int n)
+{
+  std::vector<double> weights(n);
+  for (int i = 0; i < n; i++)
+  {
+    weights[i] = 1.0 / (i + 1);
+  }
+  return std::discrete_distribution<int>(weights.begin(), weights.end());
+}
+
+// ARPA model over w0 .. w(vocab - 1) holding every n-gram of random Zipf sentences
+void write_synthetic_arpa(const Options &options, const std::string &path)
+{
+  std::mt19937 rng(options.seed);
+  std::discrete_distribution<int> word = zipf(options.synthetic_vocab);
+  std::uniform_int_distribution<int> length(5, 30);
+  std::uniform_real_distribution<double> prob(0.1, 4), backoff(0, 1);
+
+  std::vector<std::string> words;
+  for (int i = 0; i < options.synthetic_vocab; i++)
+  {
+    words.push_back("w" + std::to_string(i));
+  }
+  std::vector<std::set<std::vector<std::string>>> grams(options.order);
+  for (const std::string &w : words)
+  {
+    grams[0].insert({w});
+  }
+  grams[0].insert({"<s>"});
+  grams[0].insert({"</s>"});
+  grams[0].insert({"<unk>"});
+  for (int s = 0; s < options.synthetic_sentences; s++)
+  {
+    std::vector<std::string> sentence = {"<s>"};
+    for (int t = length(rng); t > 0; t--)
+    {
+      sentence.push_back(words[word(rng)]);
+    }
+    sentence.push_back("</s>");
+    for (int n = 2; n <= options.order; n++)
+    {
+      for (size_t i = 0; i + n <= sentence.size(); i++)
+      {
+        grams[n - 1].insert(std::vector<std::string>(sentence.begin() + i, sentence.begin() + i + n));
+      }
+    }
+  }
+
+  FILE *arpa = fopen(path.c_str(), "w");
+  fprintf(arpa, "\n\\data\\\n");
+  for (int n = 0; n < options.order; n++)
+  {
+    fprintf(arpa, "ngram %d=%zu\n", n + 1, grams[n].size());
+  }
+  for (int n = 0; n < options.order; n++)
+  {
+    fprintf(arpa, "\n\\%d-grams:\n", n + 1);
+    for (const std::vector<std::string> &gram : grams[n])
+    {
+      std::string joined = gram[0];
+      for (size_t i = 1; i < gram.size(); i++)
+      {
+        joined += " " + gram[i];
+      }
+      const double p = (n == 0 && gram[0] == "<s>") ? -99 : -prob(rng);
+      if (n < options.order - 1 && gram.back() != "</s>")
+      {
+        fprintf(arpa, "%f\t%s\t%f\n", p, joined.c_str(), -backoff(rng));
+      }
+      else
+      {
+        fprintf(arpa, "%f\t%s\n", p, joined.c_str());
+      }
+    }
+  }
+  fprintf(arpa, "\n\\end\\\n");
+  fclose(arpa);
+}
+
+// load lm once to list its words, compiling it to a probing binary if it is an ARPA file;
+// return the path the decoder should load
+std::string prepare_model(const std::string &lm, std::vector<std::string> &words, std::string &compiled)
+{
+  RetriveStrEnumerateVocab enumerate;
+  lm::ngram::Config config;
+  config.enumerate_vocab = &enumerate;
+  config.messages = nullptr;
+  lm::ngram::ModelType model_type;
+  std::string path = lm;
+  if (!lm::ngram::RecognizeBinary(lm.c_str(), model_type))
+  {
+    compiled = temp_path(".probing");
+    config.write_mmap = compiled.c_str();
+    model_type = lm::ngram::PROBING;
+    path = compiled;
+  }
+  auto start = std::chrono::steady_clock::now();
+  delete lm::ngram::LoadVirtual(lm.c_str(), config, model_type);
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  if (!compiled.empty())
+  {
+    printf("compiled %s to a probing binary in %.3f s\n", lm.c_str(), seconds);
+  }
+
+  for (const std::string &word : enumerate.vocabulary)
+  {
+    if (word != "<s>" && word != "</s>" && word != "<unk>")
+    {
+      words.push_back(word);
+    }
+  }
+  return path;
+}
+
+template <typename T>
+TensorView view_of(std::vector<T> &data, DType dtype, std::vector<int64_t> sizes)
+{
+  TensorView view;
+  view.data = data.data();
+  view.dtype = dtype;
+  view.dim = sizes.size();
+  int64_t stride = 1;
+  for (int d = view.dim - 1; d >= 0; d--)
+  {
+    view.sizes[d] = sizes[d];
+    view.strides[d] = stride;
+    stride *= sizes[d];
+  }
+  return view;
+}
+
+// one synthetic batch with its inputs and outputs
+struct Batch
+{
+  std::vector<float> probs;    // batch x max_length x short_list
+  std::vector<int32_t> seqs;   // batch x max_length x short_list
+  std::vector<float> gates;    // batch x max_length
+  std::vector<int32_t> lens;   // batch
+  std::vector<int32_t> targets;  // batch x max_length, the top TM candidates
+
+  std::vector<int32_t> out_seqs;
+  std::vector<float> out_scores;
+  std::vector<float> lm_scores;  // batch x (max_length + 1)
+
+  int64_t tokens;
+
+  // probs, seqs, gates, lens, out_seqs, out_scores / targets, lens, lm_scores
+  std::vector<TensorView> search_views;
+  std::vector<TensorView> score_views;
+};
+
+Batch make_batch(const Options &options, int vocab_size, std::mt19937 &rng)
+{
+  const int B = options.batch, L = options.max_length, C = options.short_list;
+  std::discrete_distribution<int> word = zipf(vocab_size - 2);
+  std::uniform_real_distribution<float> unit(0, 1), gate(0.2f, 0.8f);
+  std::lognormal_distribution<double> lognormal(std::log(options.length), 0.6);
+
+  Batch batch;
+  batch.probs.resize(B * L * C);
+  batch.seqs.resize(B * L * C);
+  batch.gates.resize(B * L);
+  batch.lens.resize(B);
+  batch.targets.resize(B * L);
+  batch.out_seqs.resize(B * L * options.beam);
+  batch.out_scores.resize(B * options.beam);
+  batch.lm_scores.resize(B * (L + 1));
+  batch.tokens = 0;
+
+  for (int b = 0; b < B; b++)
+  {
+    int length = options.length;
+    if (options.length_dist == "uniform")
+    {
+      length = 1 + rng() % (2 * options.length);
+    }
+    else if (options.length_dist == "lognormal")
+    {
+      length = static_cast<int>(lognormal(rng));
+    }
+    batch.lens[b] = std::min(std::max(length, 1), L);
+    batch.tokens += batch.lens[b];
+
+    for (int t = 0; t < L; t++)
+    {
+      batch.gates[b * L + t] = gate(rng);
+      // decreasing probabilities over the short list, summing to less than one
+      float *probs = &batch.probs[(b * L + t) * C];
+      float sum = 0;
+      for (int c = 0; c < C; c++)
+      {
+        probs[c] = -std::log(1 - unit(rng) * 0.999f);
+        sum += probs[c];
+      }
+      std::sort(probs, probs + C, std::greater<float>());
+      for (int c = 0; c < C; c++)
+      {
+        probs[c] *= 0.9f / sum;
+        batch.seqs[(b * L + t) * C + c] = 2 + word(rng);  // 0, 1 are <init>, <eos>
+      }
+      batch.targets[b * L + t] = batch.seqs[(b * L + t) * C];
+    }
+  }
+  return batch;
+}
+
+double percentile(std::vector<double> values, double p)
+{
+  if (values.empty())
+  {
+    return 0;
+  }
+  std::sort(values.begin(), values.end());
+  return values[std::min(values.size() - 1, static_cast<size_t>(p * values.size()))];
+}
+
+struct Result
+{
+  double sentences_per_second;
+  double tokens_per_second;
+  double p50_ms;
+  double p99_ms;
+};
+
+/* Throughput over whole batches through the batch entry point, then the
+ * latency of each sentence, decoded one by one on the same workers. */
+template <class BatchFn, class SentenceFn>
+Result measure(WorkerPool &pool, std::vector<Batch> &batches, const BatchFn &run_batch,
+               const SentenceFn &run_sentence)
+{
+  typedef std::chrono::steady_clock Clock;
+  int64_t sentences = 0, tokens = 0;
+  run_batch(batches[0]);  // warm up the caches and the page cache
+
+  Clock::time_point start = Clock::now();
+  for (Batch &batch : batches)
+  {
+    run_batch(batch);
+    sentences += batch.lens.size();
+    tokens += batch.tokens;
+  }
+  double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+  std::vector<double> latencies;
+  for (Batch &batch : batches)
+  {
+    std::vector<double> batch_latencies(batch.lens.size());
+    pool.parallel_for(batch.lens.size(), 1, [&](size_t worker, size_t begin, size_t end) {
+      for (size_t i = begin; i < end; i++)
+      {
+        Clock::time_point sentence_start = Clock::now();
+        run_sentence(batch, worker, i);
+        batch_latencies[i] = std::chrono::duration<double, std::milli>(Clock::now() - sentence_start).count();
+      }
+    });
+    latencies.insert(latencies.end(), batch_latencies.begin(), batch_latencies.end());
+  }
+
+  Result result;
+  result.sentences_per_second = sentences / seconds;
+  result.tokens_per_second = tokens / seconds;
+  result.p50_ms = percentile(latencies, 0.5);
+  result.p99_ms = percentile(latencies, 0.99);
+  return result;
+}
+
+void report(const char *name, int workers, const Result &result, const Result &first)
+{
+  printf("%-12s %7d %12.1f %12.1f %9.3f %9.3f %8.2fx\n", name, workers, result.sentences_per_second,
+         result.tokens_per_second, result.p50_ms, result.p99_ms,
+         result.sentences_per_second / first.sentences_per_second);
+}
+
+} // namespace
+
+int main(int argc, char *argv[])
+{
+  Options options = parse(argc, argv);
+  std::map<std::string, int> types = {{"moe", 0}, {"shallow", 1}, {"simple", 2}};
+  if (!types.count(options.type))
+  {
+    usage(argv[0]);
+  }
+
+  std::string synthetic;
+  if (options.synthetic_vocab > 0)
+  {
+    synthetic = temp_path(".arpa");
+    write_synthetic_arpa(options, synthetic);
+    options.lm = synthetic;
+  }
+  std::vector<std::string> words;
+  std::string compiled;
+  std::string model_path = prepare_model(options.lm, words, compiled);
+  const bool restricted = options.restrict_vocab > 0;
+  if (restricted && compiled.empty())
+  {
+    fprintf(stderr, "--restrict-vocab needs an ARPA model\n");
+    return 1;
+  }
+
+  // MT vocabulary: the LM words (restrict_vocab of them) plus oov_rate unknown ones
+  std::vector<std::string> vocab = {"<init>", "<eos>"};
+  std::mt19937 rng(options.seed);
+  std::shuffle(words.begin(), words.end(), rng);
+  if (restricted && static_cast<size_t>(options.restrict_vocab) < words.size())
+  {
+    words.resize(options.restrict_vocab);
+  }
+  const int oovs = static_cast<int>(words.size() * options.oov_rate);
+  for (size_t i = 0; i < words.size(); i++)
+  {
+    vocab.push_back(words[i]);
+    if (static_cast<int>(i) < oovs)
+    {
+      vocab.push_back("<oov" + std::to_string(i) + ">");
+    }
+  }
+
+  Scorer scorer(restricted ? options.lm : model_path, vocab, util::POPULATE_OR_READ,
+                restricted ? options.binary_cache : "", lm::ngram::PROBING, restricted);
+  std::map<std::string, double> load = scorer.get_load_stats();
+  printf("model %s: order %zu, %zu LM words, %zu MT words, loaded in %.3f s\n", options.lm.c_str(),
+         scorer.get_max_order(), words.size(), vocab.size(), load["load_seconds"]);
+  if (restricted)
+  {
+    printf("restricted to the MT vocabulary (%s in %.3f s): %.0f of %.0f n-grams (%.2f%%), %.1f of %.1f MB\n",
+           load["binary_cache_hit"] ? "cached" : "built", load["build_seconds"], load["kept_ngrams"],
+           load["ngrams"], 100 * load["kept_ngrams"] / load["ngrams"], load["kept_model_bytes"] / 1e6,
+           load["model_bytes"] / 1e6);
+  }
+  printf("batch %d x %d batches, length %d (%s, max %d), short_list %d, beam %d, type %s, cache %d, "
+         "prune_margin %g\n",
+         options.batch, options.batches, options.length, options.length_dist.c_str(), options.max_length,
+         options.short_list, options.beam, options.type.c_str(), options.cache, options.prune_margin);
+
+  std::vector<Batch> batches;
+  for (int i = 0; i < options.batches; i++)
+  {
+    batches.push_back(make_batch(options, vocab.size(), rng));
+  }
+
+  const int B = options.batch, L = options.max_length, C = options.short_list, K = options.beam;
+  const int type = types[options.type];
+  const float margin = options.prune_margin;
+  for (Batch &batch : batches)
+  {
+    batch.search_views = {
+        view_of(batch.probs, DType::Float32, {B, L, C}), view_of(batch.seqs, DType::Int32, {B, L, C}),
+        view_of(batch.gates, DType::Float32, {B, L}), view_of(batch.lens, DType::Int32, {B}),
+        view_of(batch.out_seqs, DType::Int32, {B, L, K}), view_of(batch.out_scores, DType::Float32, {B, K})};
+    batch.score_views = {
+        view_of(batch.targets, DType::Int32, {B, L}), view_of(batch.lens, DType::Int32, {B}),
+        view_of(batch.lm_scores, DType::Float32, {B, L + 1})};
+  }
+
+  // the restricted model must score the batches as the full one
+  if (restricted)
+  {
+    Scorer full(model_path, vocab);
+    WorkerPool pool(1);
+    double max_difference = 0;
+    int64_t compared = 0;
+    for (Batch &batch : batches)
+    {
+      const std::vector<TensorView> &v = batch.score_views;
+      kenlm_scores_batch(&full, &pool, v[0], v[1], v[2]);
+      std::vector<float> expected = batch.lm_scores;
+      kenlm_scores_batch(&scorer, &pool, v[0], v[1], v[2]);
+      for (size_t i = 0; i < expected.size(); i++)
+      {
+        max_difference = std::max(max_difference, static_cast<double>(std::fabs(expected[i] - batch.lm_scores[i])));
+      }
+      compared += batch.tokens + B;
+    }
+    printf("verified %lld LM scores against the full model: max difference %g\n",
+           static_cast<long long>(compared), max_difference);
+  }
+
+  printf("\n%-12s %7s %12s %12s %9s %9s %9s\n", "", "workers", "sentences/s", "tokens/s", "p50 ms", "p99 ms",
+         "scaling");
+  Result first_search = Result(), first_scores = Result();
+  for (size_t w = 0; w < options.workers.size(); w++)
+  {
+    WorkerPool pool(options.workers[w]);
+    scorer.set_cache(options.workers[w], options.cache);
+
+    Result search = measure(
+        pool, batches,
+        [&](Batch &batch) {
+          const std::vector<TensorView> &v = batch.search_views;
+          beam_search_batch(&scorer, &pool, v[0], v[1], v[2], v[3], v[4], v[5], K, type, margin);
+        },
+        [&](Batch &batch, size_t worker, size_t i) {
+          const std::vector<TensorView> &v = batch.search_views;
+          beam_search_sentence(&scorer, v[0], v[1], v[2], v[3], v[4], v[5], K, i, type, scorer.get_cache(worker),
+                               nullptr, margin);
+        });
+    Result scores = measure(
+        pool, batches,
+        [&](Batch &batch) {
+          const std::vector<TensorView> &v = batch.score_views;
+          kenlm_scores_batch(&scorer, &pool, v[0], v[1], v[2]);
+        },
+        [&](Batch &batch, size_t worker, size_t i) {
+          const std::vector<TensorView> &v = batch.score_views;
+          kenlm_scores_sentence(&scorer, v[0], v[1], v[2], i, scorer.get_cache(worker));
+        });
+    if (w == 0)
+    {
+      first_search = search;
+      first_scores = scores;
+    }
+    report("beam_search", options.workers[w], search, first_search);
+    report("lm_scores", options.workers[w], scores, first_scores);
+  }
+
+  // LM lookups done and skipped per sentence, over one more pass with the statistics on
+  {
+    WorkerPool pool(1);
+    scorer.set_cache(1, options.cache);
+    scorer.set_stats(1, true);
+    for (Batch &batch : batches)
+    {
+      const std::vector<TensorView> &v = batch.search_views;
+      beam_search_batch(&scorer, &pool, v[0], v[1], v[2], v[3], v[4], v[5], K, type, margin);
+    }
+    std::map<std::string, double> stats = scorer.get_decoder_stats();
+    const double sentences = std::max(stats["sentences"], 1.0);
+    printf("\nLM lookups per sentence: %.1f done, %.1f skipped by pruning (%.1f%%)\n",
+           stats["lm_lookups"] / sentences, stats["lm_pruned_per_sentence"],
+           100 * stats["lm_pruned"] / std::max(stats["lm_lookups"] + stats["lm_pruned"], 1.0));
+    scorer.set_stats(1, false);
+  }
+
+  if (!synthetic.empty())
+  {
+    unlink(synthetic.c_str());
+  }
+  if (!compiled.empty())
+  {
+    unlink(compiled.c_str());
+  }
+  return 0;
+}
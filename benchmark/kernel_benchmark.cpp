@@ -0,0 +1,187 @@
+/* Microbenchmark of one beam search step: the fused scoring / top-k kernels
+ * of beam_kernels.h against the previous per-candidate path (std::log per
+ * beam and candidate, weighted_logsumexp, log_sum_exp, argtopk).
+ * LM scores are random, only the TM / fusion / selection work is timed.
+ *
+ * make -C benchmark  (or: g++ -O3 -std=c++11 -Ilm_decoder/src benchmark/kernel_benchmark.cpp -o kernel_benchmark)
+ * ./kernel_benchmark [steps]
+ */
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <numeric>
+#include <random>
+#include <vector>
+
+#include "beam_kernels.h"
+
+namespace reference {
+
+template <typename T>
+std::vector<size_t> argtopk(const std::vector<T> &v, int k)
+{
+  std::vector<size_t> idx(v.size());
+  std::iota(idx.begin(), idx.end(), 0);
+  std::nth_element(idx.begin(), idx.begin() + k, idx.end(),
+                   [&v](size_t i1, size_t i2) { return v[i1] > v[i2]; });
+  return idx;
+}
+
+float log_sum_exp(std::vector<float> &v, int begin, int end)
+{
+  float init = 0;
+  float max_elem = *std::max_element(v.begin() + begin, v.begin() + end);
+  float sum = std::accumulate(v.begin() + begin, v.begin() + end, init,
+     [max_elem](float a, float b) { return a + std::exp(b - max_elem); });
+  return max_elem + std::log(sum);
+}
+
+float weighted_logsumexp(float x, float y, float g)
+{
+  if (x > y){
+    return x + std::log(g + (1 - g) * std::exp(y - x));
+  }
+  else{
+    return y + std::log((1 - g) + g * std::exp(x - y));
+  }
+}
+
+// one step of the previous _beam_search_, returns the (unordered) selected candidates
+std::vector<size_t> step(int type, int beam_width, int num_candidates, const float *probs, const float *lm,
+                         float gate, const std::vector<float> &cum_scores, std::vector<float> &temp_scores)
+{
+  for (int b = 0; b < beam_width; b++)
+  {
+    for (int c = 0; c < num_candidates; c++)
+    {
+      const float y = lm[b * num_candidates + c];
+      if (type == 0){
+        temp_scores[b * num_candidates + c] = cum_scores[b] + weighted_logsumexp(std::log(probs[c]), y, gate);
+      }
+      else if (type == 1){
+        temp_scores[b * num_candidates + c] = cum_scores[b] + gate * std::log(probs[c]) + (1 - gate) * y;
+      }
+      else{
+        temp_scores[b * num_candidates + c] = gate * std::log(probs[c]) + (1 - gate) * y;
+      }
+    }
+    if (type == 2){
+      float Z = log_sum_exp(temp_scores, b * num_candidates, (b + 1) * num_candidates);
+      for (int c = 0; c < num_candidates; c++)
+      {
+        temp_scores[b * num_candidates + c] = cum_scores[b] + temp_scores[b * num_candidates + c] - Z;
+      }
+    }
+  }
+  std::vector<size_t> idx = argtopk(temp_scores, beam_width);
+  idx.resize(beam_width);
+  return idx;
+}
+
+} // namespace reference
+
+// one step with the fused kernels, the selected candidates are left in idx
+void fused_step(int type, int beam_width, int num_candidates, const float *probs, const float *lm,
+                float gate, const std::vector<float> &cum_scores, std::vector<float> &tm_scores,
+                std::vector<float> &temp_scores, std::vector<int> &idx)
+{
+  for (int c = 0; c < num_candidates; c++)
+  {
+    tm_scores[c] = std::log(probs[c]);
+  }
+  for (int b = 0; b < beam_width; b++)
+  {
+    fuse_scores(type, cum_scores[b], tm_scores.data(), lm + b * num_candidates, gate,
+                num_candidates, &temp_scores[b * num_candidates]);
+  }
+  select_topk(temp_scores.data(), beam_width * num_candidates, beam_width, idx.data());
+}
+
+// scores of the selected candidates from best to worst
+template <typename Index>
+std::vector<float> selected_scores(const std::vector<float> &scores, const std::vector<Index> &idx)
+{
+  std::vector<float> selected;
+  for (Index i : idx)
+  {
+    selected.push_back(scores[i]);
+  }
+  std::sort(selected.begin(), selected.end(), std::greater<float>());
+  return selected;
+}
+
+int main(int argc, char *argv[])
+{
+  const int steps = argc > 1 ? atoi(argv[1]) : 20000;
+  const int beams[] = {1, 4, 5, 8, 16, 32};
+  const int candidates[] = {10, 30, 100};
+  std::mt19937 rng(1);
+  std::uniform_real_distribution<float> unit(0.001f, 1.0f), lm_dist(-12.0f, -0.1f);
+
+  printf("type beam short_list  reference(ns/step)  fused(ns/step)  speedup  same top-k\n");
+  for (int type = 0; type < 3; type++)
+  {
+    for (int beam_width : beams)
+    {
+      for (int num_candidates : candidates)
+      {
+        if (beam_width > num_candidates)
+        {
+          continue;
+        }
+        const int rows = 64;  // cycle through a few steps so branch predictors do not memorise one
+        std::vector<float> probs(rows * num_candidates), lm(rows * beam_width * num_candidates), gates(rows);
+        std::vector<float> cum_scores(beam_width);
+        for (float &p : probs) p = unit(rng);
+        for (float &l : lm) l = lm_dist(rng);
+        for (float &g : gates) g = unit(rng);
+        for (float &s : cum_scores) s = -10 * unit(rng);
+
+        std::vector<float> temp_scores(beam_width * num_candidates), tm_scores(num_candidates);
+        std::vector<int> idx(beam_width);
+
+        size_t sink = 0;
+        auto t0 = std::chrono::steady_clock::now();
+        for (int i = 0; i < steps; i++)
+        {
+          const int r = i % rows;
+          sink += reference::step(type, beam_width, num_candidates, &probs[r * num_candidates],
+                                  &lm[r * beam_width * num_candidates], gates[r], cum_scores, temp_scores)[0];
+        }
+        auto t1 = std::chrono::steady_clock::now();
+        for (int i = 0; i < steps; i++)
+        {
+          const int r = i % rows;
+          fused_step(type, beam_width, num_candidates, &probs[r * num_candidates],
+                     &lm[r * beam_width * num_candidates], gates[r], cum_scores, tm_scores, temp_scores, idx);
+          sink += idx[0];
+        }
+        auto t2 = std::chrono::steady_clock::now();
+
+        // both paths must keep the same scores
+        int agree = 0;
+        for (int r = 0; r < rows; r++)
+        {
+          std::vector<float> reference_scores(temp_scores.size());
+          std::vector<size_t> reference_idx = reference::step(
+              type, beam_width, num_candidates, &probs[r * num_candidates],
+              &lm[r * beam_width * num_candidates], gates[r], cum_scores, reference_scores);
+          fused_step(type, beam_width, num_candidates, &probs[r * num_candidates],
+                     &lm[r * beam_width * num_candidates], gates[r], cum_scores, tm_scores, temp_scores, idx);
+          agree += selected_scores(reference_scores, reference_idx) == selected_scores(temp_scores, idx);
+        }
+
+        double reference_ns = std::chrono::duration<double, std::nano>(t1 - t0).count() / steps;
+        double fused_ns = std::chrono::duration<double, std::nano>(t2 - t1).count() / steps;
+        printf("%4d %4d %10d  %18.1f  %14.1f  %6.2fx  %d/%d\n", type, beam_width, num_candidates,
+               reference_ns, fused_ns, reference_ns / fused_ns, agree, rows);
+        volatile size_t keep = sink;
+        (void)keep;
+      }
+    }
+  }
+  return 0;
+}
@@ -7,6 +7,8 @@ import warnings
 
 import wget
 import setuptools
+import distutils.ccompiler
+import distutils.sysconfig
 from torch.utils.cpp_extension import CppExtension, include_paths
 
 def download_extract(url, dl_path):
@@ -52,6 +54,8 @@ third_party_libs = ["kenlm", "ThreadPool", "boost_1_67_0"]
 compile_args.extend(['-DINCLUDE_KENLM', '-DKENLM_MAX_ORDER=6'])
 lib_sources = glob.glob('third_party/kenlm/util/*.cc') + glob.glob('third_party/kenlm/lm/*.cc') + glob.glob(
     'third_party/kenlm/util/double-conversion/*.cc')
+# lm/filter restricts ARPA models to the MT vocabulary (binary_cache.cpp)
+lib_sources += ['third_party/kenlm/lm/filter/arpa_io.cc']
 lib_sources = [fn for fn in lib_sources if not (fn.endswith('main.cc') or fn.endswith('test.cc'))]
 third_party_includes = [os.path.realpath(os.path.join("third_party", lib)) for lib in third_party_libs]
 sources = glob.glob("lm_decoder/src/*.cpp")
@@ -64,4 +68,35 @@ extension = CppExtension(
    include_dirs=third_party_includes + include_paths(),
    libraries=ext_libs,
    extra_compile_args=compile_args,
-   language='c++')
\ No newline at end of file
+   language='c++')
+
+
+# name: (main, whether it links the torch-free part of the extension (everything but binding.cpp) and KenLM)
+benchmarks = {
+    'decoder_benchmark': ('benchmark/decoder_benchmark.cpp', True),
+    'kernel_benchmark': ('benchmark/kernel_benchmark.cpp', False),
+}
+benchmark_sources = [fn for fn in sources if not fn.endswith('binding.cpp')] + lib_sources
+
+
+class BuildBenchmark(setuptools.Command):
+    description = 'build the C++ benchmarks into build/'
+    user_options = []
+
+    def initialize_options(self):
+        pass
+
+    def finalize_options(self):
+        pass
+
+    def run(self):
+        compiler = distutils.ccompiler.new_compiler()
+        distutils.sysconfig.customize_compiler(compiler)
+        include_dirs = third_party_includes + ['lm_decoder/src']
+        objects = compiler.compile(benchmark_sources, output_dir='build/benchmark',
+                                   include_dirs=include_dirs, extra_postargs=compile_args)
+        for name, (main, link_decoder) in benchmarks.items():
+            main_objects = compiler.compile([main], output_dir='build/benchmark',
+                                            include_dirs=include_dirs, extra_postargs=compile_args)
+            compiler.link_executable(main_objects + (objects if link_decoder else []), name, output_dir='build',
+                                     libraries=ext_libs + ['pthread'], target_lang='c++')
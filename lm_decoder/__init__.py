@@ -2,55 +2,471 @@ import torch
 from ._ext import lm_decoder
 
 
+LOAD_METHODS = {'lazy': 0, 'populate_or_lazy': 1, 'populate_or_read': 2, 'read': 3, 'parallel_read': 4}
+INTERPOLATIONS = {'linear': 0, 'log_linear': 1}
+BINARY_TYPES = {'probing': 0, 'trie': 2, 'quant_trie': 3}
+TYPES = {'moe': 0, 'shallow': 1, 'simple': 2}
+
+
 class KenLMDecoder(object):
-    def __init__(self, vocab=None, model_path=None):
+    """
+    load_method (binary models only, ARPA files are always parsed into memory):
+        lazy:              mmap the model, pages are read in by the first queries
+        populate_or_lazy:  mmap and prefault the whole model (MAP_POPULATE) while loading
+        populate_or_read:  the same, or read a private copy where MAP_POPULATE is not available (default)
+        read:              read a private copy (on huge pages when the system has some)
+        parallel_read:     read a private copy with several threads, for network filesystems
+
+    sharing one model between processes:
+        the mmap methods map the binary model shared and read-only, so the processes of a box
+        that load the same file (data loaders, serving workers, ...) all use one copy of it in
+        the page cache instead of one copy each. use populate_or_lazy for a predictable cold
+        start: the first process pays the disk reads, the later ones only map pages that are
+        already cached. load_stats() shows it: the model shows up in shared_bytes, not as
+        private memory. read / parallel_read always give each process its own copy.
+
+    cache_size:
+        entries of the per-thread cache of LM scores by (KenLM state, word), off (0) by default.
+        beams that share an n-gram context then skip KenLM's tables; cache_stats() shows the hit
+        rate. each entry takes 96 bytes, per thread and per model: 16384 entries are 1.5 MB a
+        thread, 30 MB with 20 workers.
+
+    binary_cache_dir:
+        ARPA files (.arpa, .arpa.gz, ...) are parsed on every load, which takes minutes and a lot
+        of memory on large models. given a directory, each ARPA file is compiled once into a KenLM
+        binary of binary_type (probing: fastest, trie: smaller, quant_trie: smallest, 8 bit
+        probabilities) stored there under a hash of its content, and every later load, from any
+        process, maps that binary instead. load_stats() reports binary_cache_hit, hash_seconds
+        and build_seconds.
+
+    restrict_vocab:
+        the decoder only ever looks up n-grams of the MT vocabulary, yet loads the whole model.
+        with restrict_vocab (needs binary_cache_dir and an ARPA model), the cached binary only
+        keeps the n-grams made of vocab (and of <s>, </s>, <unk>), so its tables are much smaller
+        and fit the CPU caches better. scores of MT words are unchanged (up to quantization with
+        quant_trie), other words become unknown. load_stats() reports ngrams / kept_ngrams and model_bytes / kept_model_bytes.
+
+    ensembles:
+        model_path may be a list of models (e.g. a general-domain and an in-domain LM) that are
+        scored together in one search, with lm_weights (equal by default) and an interpolation of
+            linear:      log( sum_m w_m * p_m ), the weights are normalized to sum to 1
+            log_linear:  sum_m w_m * log p_m, the weights are used as given
+        the combined log prob takes the place of the LM's in every fusion type. the TM side, top-k
+        and reordering are done once; each model keeps its own states, cache and statistics
+        (cache_stats, stats and load_stats take the index of the model, stage times and sentences
+        are counted on the first one). prune_margin and incremental_scores need a single model.
+    """
+    def __init__(self,
+                 vocab=None,
+                 model_path=None,
+                 workers=20,
+                 pin_cpus=False,
+                 cache_size=0,
+                 load_method='populate_or_read',
+                 stats=False,
+                 lm_weights=None,
+                 interpolation='linear',
+                 binary_cache_dir=None,
+                 binary_type='probing',
+                 restrict_vocab=False):
         self.vocab = vocab
-        self.lm_scorer = lm_decoder.get_kenlm_scorer(model_path, vocab)
+        paths = model_path if isinstance(model_path, (list, tuple)) else [model_path]
+        self.lm_scorers = [lm_decoder.get_kenlm_scorer(path, vocab, LOAD_METHODS[load_method],
+                                                       binary_cache_dir or '', BINARY_TYPES[binary_type],
+                                                       restrict_vocab)
+                           for path in paths]
+        self.lm_scorer = self.lm_scorers[0]
+        self.ensemble = None
+        if isinstance(model_path, (list, tuple)):
+            if lm_weights is None:
+                lm_weights = [1.0 / len(paths)] * len(paths)
+            self.ensemble = lm_decoder.get_ensemble(self.lm_scorers, [float(w) for w in lm_weights],
+                                                    INTERPOLATIONS[interpolation])
+        self.pool = None
+        self.cache_size = cache_size
+        self.stats_enabled = stats
+        self._pending = []
+        self.set_workers(workers, pin_cpus)
+
+    def __del__(self):
+        if getattr(self, 'pool', None) is not None:
+            lm_decoder.free_worker_pool(self.pool)
+            self.pool = None
+        if getattr(self, 'ensemble', None) is not None:
+            lm_decoder.free_ensemble(self.ensemble)
+            self.ensemble = None
+
+    def set_workers(self, workers, pin_cpus=False):
+        """
+        (re)creates the decoding threads, which are kept alive and reused by every call.
+        inputs:
+            workers:   number of threads
+            pin_cpus:  pin each thread to one of the CPU cores the process may run on (taskset, cgroups)
+        """
+        self.wait_all()
+        if self.pool is not None:
+            lm_decoder.free_worker_pool(self.pool)
+        self.pool = lm_decoder.get_worker_pool(workers, pin_cpus)
+        self.workers = workers
+        self.pin_cpus = pin_cpus
+        for lm_scorer in self.lm_scorers:
+            lm_decoder.set_cache(lm_scorer, workers, self.cache_size)
+            lm_decoder.set_stats(lm_scorer, workers, self.stats_enabled)
+
+    def set_cache_size(self, cache_size):
+        """
+        resizes the per-thread LM score caches (in entries), 0 turns caching off.
+        """
+        self.wait_all()
+        self.cache_size = cache_size
+        for lm_scorer in self.lm_scorers:
+            lm_decoder.set_cache(lm_scorer, self.workers, cache_size)
+
+    def cache_stats(self, model=0):
+        """
+        return:
+            dict of hits, misses, hit_rate and entries (per thread) of the LM score caches,
+            once the outstanding asynchronous batches are decoded
+        """
+        self.wait_all()
+        return lm_decoder.get_cache_stats(self.lm_scorers[model])
+
+    def reset_cache_stats(self):
+        self.wait_all()
+        for lm_scorer in self.lm_scorers:
+            lm_decoder.reset_cache_stats(lm_scorer)
+
+    def enable_stats(self, enabled=True):
+        """
+        turns the decoding statistics on or off (and resets them).
+        when off, decoding only pays one branch per stage for them.
+        """
+        self.wait_all()
+        self.stats_enabled = enabled
+        for lm_scorer in self.lm_scorers:
+            lm_decoder.set_stats(lm_scorer, self.workers, enabled)
 
-    def language_model_scores(self, targets, masks, workers=20):
+    def stats(self, model=0):
+        """
+        return:
+            dict of the decoding statistics summed over the threads since they were enabled or reset:
+            lm_lookups, lm_queries (lookups that missed the cache), oov, sentences, tokens,
+            lm_pruned (lookups skipped by prune_margin) and lm_pruned_per_sentence,
+            time spent per stage of the beam search in seconds (read, lm, fuse, topk, reorder, finish),
+            score_seconds (language_model_scores), decode_seconds (whole sentences),
+            queue_wait_seconds (from the call until a thread picks up each chunk of sentences),
+            latency_us_<b>: sentences that took less than b microseconds (and at least b / 2),
+            latency_p50_us / latency_p99_us: upper bounds of the buckets holding the percentiles
+            the threads update them without locks, so this first waits for the outstanding
+            asynchronous batches (wait_all), as reset_stats does.
+        """
+        self.wait_all()
+        return lm_decoder.get_decoder_stats(self.lm_scorers[model])
+
+    def reset_stats(self):
+        self.wait_all()
+        for lm_scorer in self.lm_scorers:
+            lm_decoder.reset_decoder_stats(lm_scorer)
+
+    def load_stats(self, model=0):
+        """
+        return:
+            dict of load_seconds, and of the resident (rss_bytes) and file backed shared
+            (shared_bytes) memory of the process right after loading the model, with the
+            growth of the resident memory during the load (rss_delta_bytes). Linux only.
+            with binary_cache_dir and an ARPA model: binary_cache (1), binary_cache_hit,
+            hash_seconds (finding the entry) and build_seconds (compiling it on a miss).
+            with restrict_vocab: restricted (1), the n-grams of the ARPA file (ngrams) and of the
+            loaded binary (kept_ngrams), and the memory they take (model_bytes, kept_model_bytes).
+        """
+        return lm_decoder.get_load_stats(self.lm_scorers[model])
+
+    def busy_time(self):
+        """
+        return:
+            list of the seconds each thread spent decoding since the threads were created or
+            reset_busy_time was called. sentences are handed out longest first, in chunks that
+            shrink down to one sentence, so on a skewed batch these should stay close to each other.
+        """
+        return lm_decoder.get_busy_time(self.pool)
+
+    def reset_busy_time(self):
+        lm_decoder.reset_busy_time(self.pool)
+
+    def _check_workers(self, workers):
+        if workers is not None and workers != self.workers:
+            self.set_workers(workers, self.pin_cpus)
+
+    def language_model_scores(self, targets, masks, workers=None, out=None):
         """
         inputs:
-            targets:  batch x seqlen
+            targets:  batch x seqlen (int32 or int64)
             masks:    batch x seqlen
+            out:      optional CPU float tensor of batch x (seqlen + 1) to write the scores into,
+                      entries past each sentence are left untouched
+
+        tensors are read in place (any dtype and strides), only CUDA inputs are copied to the CPU.
         """
-        lm_scores = targets.new_zeros(targets.size(0),
-                                      targets.size(1) + 1).cpu().float()
-        lm_decoder.get_kenlm_scores(self.lm_scorer,
-                                    targets.cpu().int(),
-                                    masks.sum(1).cpu().int(), lm_scores,
-                                    workers)
-        if targets.is_cuda:
+        self._check_workers(workers)
+        lm_scores = out
+        if lm_scores is None:
+            lm_scores = torch.zeros(targets.size(0), targets.size(1) + 1)
+        if self.ensemble is not None:
+            lm_decoder.get_kenlm_scores_ensemble(self.ensemble, self.pool,
+                                                 targets.cpu(), masks.cpu(), lm_scores)
+        else:
+            lm_decoder.get_kenlm_scores(self.lm_scorer, self.pool,
+                                        targets.cpu(), masks.cpu(), lm_scores)
+        if targets.is_cuda and out is None:
             lm_scores = lm_scores.cuda(targets.get_device())
         return lm_scores
 
+    def _beam_search_args(self, mt_probs, gates, masks, short_list, beam_size, type, out_scores, prune_margin):
+        probs, seqs = mt_probs.topk(short_list, 2)
+        _seqs = seqs.cpu()
+        scores = out_scores
+        if scores is None:
+            scores = torch.empty(seqs.size(0), beam_size)
+        # the n-best is written over the candidates in _seqs
+        args = (self.pool, probs.cpu(), _seqs, gates.cpu(), masks.cpu(), _seqs, scores, beam_size, TYPES[type])
+        if self.ensemble is not None:
+            if prune_margin is not None:
+                raise ValueError('prune_margin needs a single language model')
+            args = (self.ensemble,) + args
+        else:
+            args = (self.lm_scorer,) + args + (-1.0 if prune_margin is None else float(prune_margin),)
+        device = seqs.get_device() if seqs.is_cuda else None
+        return args, scores, _seqs, device
+
+    def incremental_scores(self):
+        """
+        return:
+            IncrementalLMScores, language_model_scores for a batch that is refined over several
+            passes, rescoring only what changed between them.
+        """
+        if self.ensemble is not None:
+            raise ValueError('incremental_scores needs a single language model')
+        return IncrementalLMScores(self)
+
+    def beam_session(self, beam_size=5, type='moe', prune_margin=None):
+        """
+        inputs:
+            type, prune_margin:  as for beam_search_with_language_model
+
+        return:
+            BeamSession, beam_search_with_language_model for candidates that arrive a chunk of
+            time steps at a time
+        """
+        if self.ensemble is not None:
+            raise ValueError('beam_session needs a single language model')
+        return BeamSession(self, beam_size, type, prune_margin)
+
     def beam_search_with_language_model(self,
                                         mt_probs,
                                         gates,
                                         masks,
                                         short_list=30,
                                         beam_size=5,
-                                        workers=20,
-                                        type='moe'):
+                                        workers=None,
+                                        type='moe',
+                                        out_scores=None,
+                                        prune_margin=None):
         """
         inputs:
-            mt_probs:  batch x seqlen x vocab (softmax results over a vocabulary)
+            mt_probs:  batch x seqlen x vocab (softmax results over a vocabulary, float16/bfloat16/float32)
             gates:     batch x seqlen 
             masks:     batch x seqlen
             short_list:  we do not check all the possible tokens. Only topN from the MT system is considered.
             type:      moe, shallow, simple
+            workers:   overrides the number of threads given to the constructor
+            out_scores:  optional CPU float tensor of batch x beam_size to write the scores into
+            prune_margin:  None scores every candidate with the LM. moe and shallow can skip the
+                       candidates that cannot make the beams whatever their LM score: 0 gives the
+                       same results with fewer LM queries, a positive margin (in log prob) also skips
+                       those that could only beat the last beam by less than that, trading exactness
+                       for speed. stats() counts the skipped queries in lm_pruned. contexts with
+                       positive backoff weights raise the bound and prune less, but stay exact.
+
+        return:
+            scores:    batch x beam_size, from best to worst
+            seqs:      batch x seqlen x short_list, the first beam_size entries of the last dimension
+                       hold the n-best translations
+        """
+        self._check_workers(workers)
+        args, scores, _seqs, device = self._beam_search_args(
+            mt_probs, gates, masks, short_list, beam_size, type, out_scores, prune_margin)
+        if self.ensemble is not None:
+            lm_decoder.beam_search_ensemble(*args)
+        else:
+            lm_decoder.beam_search(*args)
+        if device is not None:
+            _seqs = _seqs.cuda(device)
+        return scores, _seqs
+
+    def beam_search_with_language_model_async(self,
+                                              mt_probs,
+                                              gates,
+                                              masks,
+                                              short_list=30,
+                                              beam_size=5,
+                                              type='moe',
+                                              out_scores=None,
+                                              prune_margin=None):
+        """
+        same as beam_search_with_language_model, but returns as soon as the batch is queued
+        on the decoding threads, e.g. to run the model on the next batch meanwhile.
+        several batches may be outstanding at once, they are decoded in submission order.
+
+        return:
+            BeamSearchFuture, whose result() gives (scores, seqs)
+        """
+        self._pending = [f for f in self._pending if not f.done()]
+        args, scores, _seqs, device = self._beam_search_args(
+            mt_probs, gates, masks, short_list, beam_size, type, out_scores, prune_margin)
+        search = lm_decoder.beam_search_async if self.ensemble is None else lm_decoder.beam_search_ensemble_async
+        future = BeamSearchFuture(self, search(*args), scores, _seqs, device)
+        self._pending.append(future)
+        return future
+
+    def wait_all(self):
+        """
+        blocks until every outstanding asynchronous batch is decoded.
+        errors of a batch are left to the result() of its future.
+        """
+        pending, self._pending = self._pending, []
+        for future in pending:
+            try:
+                future.wait()
+            except Exception:
+                pass
+
+
+class IncrementalLMScores(object):
+    """
+    per-token LM scores of one batch across iterative refinement passes (e.g. mask-predict).
+    the tokens and KenLM states of every row are kept between calls, so each call only rescores
+    a row from its first changed token until the LM context is back to the one of the previous
+    pass. calling it with another batch size starts over, reset() does so explicitly.
+    """
+    def __init__(self, decoder):
+        self.decoder = decoder
+        self.handle = lm_decoder.get_incremental_scores(decoder.lm_scorer)
+
+    def __del__(self):
+        if getattr(self, 'handle', None) is not None:
+            lm_decoder.free_incremental_scores(self.handle)
+            self.handle = None
+
+    def __call__(self, targets, masks, out=None):
+        """
+        same inputs and result as KenLMDecoder.language_model_scores
+        """
+        lm_scores = out
+        if lm_scores is None:
+            lm_scores = torch.zeros(targets.size(0), targets.size(1) + 1)
+        lm_decoder.incremental_scores(self.handle, self.decoder.pool,
+                                      targets.cpu(), masks.cpu(), lm_scores)
+        if targets.is_cuda and out is None:
+            lm_scores = lm_scores.cuda(targets.get_device())
+        return lm_scores
+
+    def reset(self):
+        lm_decoder.reset_incremental_scores(self.handle)
 
+    def stats(self):
+        """
         return:
-            best translation
+            dict of positions (tokens and </s>) scored over all calls, how many of them were
+            actually rescored, and the fraction saved
+        """
+        return lm_decoder.get_incremental_stats(self.handle)
+
+
+class BeamSession(object):
+    """
+    beam search for semi-autoregressive or blockwise decoders, which emit the candidates of a
+    few time steps at a time. init() starts a batch, each step() extends the beams of every
+    sentence with the next steps and finalize() adds </s> and returns the n-best, as
+    beam_search_with_language_model would over all the steps at once.
+    the beams, KenLM states and buffers of every sentence are kept between calls and reused by
+    the next batches, so each step() only does the work of its own steps. finalize() may also be
+    called for the n-best so far, and followed by more steps; stats() counts each sentence once.
+    """
+    def __init__(self, decoder, beam_size=5, type='moe', prune_margin=None):
+        self.decoder = decoder
+        self.beam_size = beam_size
+        self.batch_size = 0
+        self.device = None
+        self.handle = lm_decoder.get_beam_session(decoder.lm_scorer, beam_size, TYPES[type],
+                                                  -1.0 if prune_margin is None else float(prune_margin))
+
+    def __del__(self):
+        if getattr(self, 'handle', None) is not None:
+            lm_decoder.free_beam_session(self.handle)
+            self.handle = None
+
+    def init(self, batch_size):
+        self.batch_size = batch_size
+        lm_decoder.beam_session_init(self.handle, batch_size)
+
+    def step(self, mt_probs, gates, masks=None, short_list=30):
+        """
+        inputs:
+            mt_probs:  batch x steps x vocab, the next steps of every sentence
+            gates:     batch x steps
+            masks:     optional batch x steps, the steps that belong to each sentence (all of them
+                       by default)
+            short_list:  number of top MT candidates considered at each step
         """
-        types = {'moe': 0, 'shallow': 1, 'simple': 2}
         probs, seqs = mt_probs.topk(short_list, 2)
-        _seqs = seqs.cpu().int()
-        scores = lm_decoder.beam_search(self.lm_scorer,
-                                        probs.cpu().float(), _seqs,
-                                        gates.cpu().float(),
-                                        masks.sum(1).cpu().int(), beam_size,
-                                        workers, types[type])
-        if seqs.is_cuda:
-            _seqs = _seqs.cuda(seqs.get_device())
-        _seqs = _seqs.type_as(seqs)
-        return scores, _seqs
\ No newline at end of file
+        if masks is None:
+            masks = torch.full((seqs.size(0),), seqs.size(1), dtype=torch.int32)
+        self.device = seqs.get_device() if seqs.is_cuda else None
+        lm_decoder.beam_session_step(self.handle, self.decoder.pool,
+                                     probs.cpu(), seqs.cpu(), gates.cpu(), masks.cpu())
+
+    def finalize(self):
+        """
+        return:
+            scores:    batch x beam_size, from best to worst
+            seqs:      batch x seqlen x beam_size, the n-best translations, seqlen being the
+                       most steps taken by a sentence (zeros past the others)
+        """
+        seqs = torch.zeros(self.batch_size, lm_decoder.beam_session_max_length(self.handle), self.beam_size,
+                           dtype=torch.long)
+        scores = torch.empty(self.batch_size, self.beam_size)
+        lm_decoder.beam_session_finalize(self.handle, self.decoder.pool, seqs, scores)
+        if self.device is not None:
+            seqs = seqs.cuda(self.device)
+        return scores, seqs
+
+
+class BeamSearchFuture(object):
+    """
+    a batch queued by KenLMDecoder.beam_search_with_language_model_async.
+    the decoder and the tensors of the batch are kept alive until it is decoded.
+    """
+    def __init__(self, decoder, handle, scores, seqs, device):
+        self.decoder = decoder
+        self.handle = handle
+        self.scores = scores
+        self.seqs = seqs
+        self.device = device
+
+    def done(self):
+        return self.handle.done()
+
+    def wait(self):
+        # the GIL is released while waiting, errors of the search are raised here
+        self.handle.wait()
+
+    def result(self):
+        """
+        return:
+            (scores, seqs) as given by beam_search_with_language_model
+        """
+        self.wait()
+        seqs = self.seqs
+        if self.device is not None:
+            seqs = seqs.cuda(self.device)
+        return self.scores, seqs
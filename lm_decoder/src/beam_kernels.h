@@ -0,0 +1,152 @@
+#ifndef BEAM_KERNELS_H_
+#define BEAM_KERNELS_H_
+
+#include <algorithm>
+#include <cmath>
+
+/* Per-step kernels of the beam search.
+ * They work on contiguous candidate arrays and never allocate, so that one
+ * step of _beam_search_ is: gather the LM scores of a beam, fuse them with
+ * the TM scores of the step, then select the top-k over all beams. */
+
+// beam sizes up to this use insertion into a sorted array, larger ones a heap
+const int TOPK_INSERTION_MAX = 16;
+
+// scores[i] = cum_score + fusion of the TM and LM log probs of candidate i
+//   type = 0: mixture of experts: log( \alpha * p_TM + (1 - \alpha) * p_LM )
+//   type = 1: shallow fusion: \alpha * log p_TM + (1 - \alpha) * log p_LM (as scores)
+//   type = 2: simple fusion: log( softmax(\alpha * TM_scores + (1 - \alpha) * log p_LM (as scores)))
+inline void fuse_scores(const int type,
+                        const float cum_score,
+                        const float *tm_scores,
+                        const float *lm_scores,
+                        const float gate,
+                        const int n,
+                        float *scores)
+{
+  if (type == 0)
+  {
+    // weighted log-sum-exp, written with selects instead of branches
+    for (int i = 0; i < n; i++)
+    {
+      const float x = tm_scores[i], y = lm_scores[i];
+      const bool tm_max = x > y;
+      const float hi = tm_max ? x : y;
+      const float lo = tm_max ? y : x;
+      const float w_hi = tm_max ? gate : (1 - gate);
+      const float w_lo = tm_max ? (1 - gate) : gate;
+      scores[i] = cum_score + (hi + std::log(w_hi + w_lo * std::exp(lo - hi)));
+    }
+  }
+  else if (type == 1)
+  {
+    for (int i = 0; i < n; i++)
+    {
+      scores[i] = cum_score + gate * tm_scores[i] + (1 - gate) * lm_scores[i];
+    }
+  }
+  else if (type == 2)
+  {
+    float max_score = -INFINITY;
+    for (int i = 0; i < n; i++)
+    {
+      scores[i] = gate * tm_scores[i] + (1 - gate) * lm_scores[i];
+      max_score = std::max(max_score, scores[i]);
+    }
+    float sum = 0;
+    for (int i = 0; i < n; i++)
+    {
+      sum += std::exp(scores[i] - max_score);
+    }
+    const float Z = max_score + std::log(sum);
+    for (int i = 0; i < n; i++)
+    {
+      scores[i] = cum_score + scores[i] - Z;
+    }
+  }
+}
+
+// float error allowed for in fusion_bound where it is not rounded like fuse_scores
+const float PRUNE_SLACK = 1e-3f;
+
+/* Upper bound of what fuse_scores adds to cum_score for a candidate whose LM
+ * log prob is at most lm_bound (>= 0), for types 0 and 1 and a gate in [0, 1];
+ * non-decreasing in tm_score and lm_bound.
+ *   type = 0: log( \alpha * p_TM + (1 - \alpha) * p_LM ) <= log( \alpha * p_TM + (1 - \alpha) * e^lm_bound )
+ *   type = 1: \alpha * log p_TM + (1 - \alpha) * lm_bound; with lm_bound = 0, cum_score + \alpha * log p_TM
+ *             is rounded like the first two terms of fuse_scores and no slack is needed */
+inline float fusion_bound(const int type, const float tm_score, const float gate, const float lm_bound)
+{
+  if (type == 1)
+  {
+    if (lm_bound == 0)
+    {
+      return gate * tm_score;
+    }
+    return gate * tm_score + (1 - gate) * lm_bound + PRUNE_SLACK;
+  }
+  return std::log(gate * std::exp(tm_score) + (1 - gate) * std::exp(lm_bound)) + PRUNE_SLACK;
+}
+
+/* Write the indices of the k largest scores into indices[0, k), from best to
+ * worst (ties go to the lower index), and return how many were written. */
+inline int select_topk(const float *scores, const int n, const int k, int *indices)
+{
+  const int size = std::min(n, k);
+  if (size <= 0)
+  {
+    return 0;
+  }
+
+  if (k <= TOPK_INSERTION_MAX)
+  {
+    int filled = 0;
+    for (int i = 0; i < n; i++)
+    {
+      const float score = scores[i];
+      int pos;
+      if (filled < size)
+      {
+        pos = filled++;
+      }
+      else if (score > scores[indices[size - 1]])
+      {
+        pos = size - 1;
+      }
+      else
+      {
+        continue;
+      }
+      while (pos > 0 && score > scores[indices[pos - 1]])
+      {
+        indices[pos] = indices[pos - 1];
+        pos--;
+      }
+      indices[pos] = i;
+    }
+    return size;
+  }
+
+  // "better" orders the heap so that its front is the worst of the kept ones
+  auto better = [scores](int a, int b) {
+    return scores[a] > scores[b] || (scores[a] == scores[b] && a < b);
+  };
+  for (int i = 0; i < size; i++)
+  {
+    indices[i] = i;
+  }
+  std::make_heap(indices, indices + size, better);
+  for (int i = size; i < n; i++)
+  {
+    if (better(i, indices[0]))
+    {
+      std::pop_heap(indices, indices + size, better);
+      indices[size - 1] = i;
+      std::push_heap(indices, indices + size, better);
+    }
+  }
+  std::sort_heap(indices, indices + size, better);
+  return size;
+}
+
+#endif  // BEAM_KERNELS_H_
@@ -0,0 +1,1094 @@
+#include "beam_search.h"
+
+#include <algorithm>
+#include <cmath>
+#include <functional>  // std::greater
+#include <numeric>  // std::iota
+#include <stdexcept>
+#include <vector>
+
+#include "beam_kernels.h"
+#include "ensemble.h"
+
+using namespace lm::ngram;
+
+/* Sentence indices from longest to shortest.
+ * Workers claim sentences one at a time in this order, so an idle worker
+ * always takes the longest one left and a long sentence is never started
+ * last while the others wait for it. */
+static std::vector<int64_t> longest_first(const TensorView &lens, int64_t batch_size)
+{
+  std::vector<int32_t> lengths(batch_size);
+  for (int64_t i = 0; i < batch_size; i++)
+  {
+    lengths[i] = get_length(lens, i);
+  }
+  std::vector<int64_t> order(batch_size);
+  std::iota(order.begin(), order.end(), 0);
+  std::stable_sort(order.begin(), order.end(),
+                   [&lengths](int64_t a, int64_t b) { return lengths[a] > lengths[b]; });
+  return order;
+}
+
+static void check_lens(const TensorView &lens, int64_t batch_size, int64_t length)
+{
+  if (lens.dim == 1)
+  {
+    if (lens.size(0) != batch_size)
+    {
+      throw std::invalid_argument("lengths must hold one entry per sentence");
+    }
+    for (int64_t i = 0; i < batch_size; i++)
+    {
+      const int32_t sentence_length = get_length(lens, i);
+      if (sentence_length < 0 || sentence_length > length)
+      {
+        throw std::invalid_argument("lengths must be between 0 and the number of time steps");
+      }
+    }
+  }
+  else if (lens.size(0) != batch_size || lens.size(1) != length)
+  {
+    throw std::invalid_argument("masks must be batch x length");
+  }
+}
+
+// The views of a search or a session step fit together, checked before any work is queued.
+// The beams are filled from the short list and ranked in place, so they cannot be wider than it.
+static void check_candidates(const TensorView &probs,
+                             const TensorView &seqs,
+                             const TensorView &gates,
+                             const TensorView &lens,
+                             const int beam_width)
+{
+  for (int d = 0; d < 3; d++)
+  {
+    if (seqs.size(d) != probs.size(d))
+    {
+      throw std::invalid_argument("probs and seqs must have the same shape");
+    }
+  }
+  if (gates.size(0) != probs.size(0) || gates.size(1) != probs.size(1))
+  {
+    throw std::invalid_argument("gates must be batch x length");
+  }
+  check_lens(lens, probs.size(0), probs.size(1));
+  if (beam_width < 1 || beam_width > probs.size(2))
+  {
+    throw std::invalid_argument("the short list must hold at least beam_width candidates");
+  }
+}
+
+// room for the n-best of batch_size sentences of up to length steps
+static void check_nbest(const TensorView &out_seqs,
+                        const TensorView &out_scores,
+                        int64_t batch_size,
+                        int64_t length,
+                        const int beam_width)
+{
+  if (out_seqs.size(0) != batch_size || out_seqs.size(1) < length || out_seqs.size(2) < beam_width)
+  {
+    throw std::invalid_argument("out_seqs must be batch x length x (>= beam_width)");
+  }
+  if (out_scores.size(0) != batch_size || out_scores.size(1) != beam_width)
+  {
+    throw std::invalid_argument("out_scores must be batch x beam_width");
+  }
+  if (out_seqs.dtype != DType::Int32 && out_seqs.dtype != DType::Int64)
+  {
+    throw std::invalid_argument("index outputs must be int32 or int64");
+  }
+  if (out_scores.dtype != DType::Float32 && out_scores.dtype != DType::Float64)
+  {
+    throw std::invalid_argument("float outputs must be float32 or float64");
+  }
+}
+
+void check_score_inputs(const TensorView &seqs, const TensorView &lens, const TensorView &outs)
+{
+  check_lens(lens, seqs.size(0), seqs.size(1));
+  if (outs.size(0) != seqs.size(0) || outs.size(1) < seqs.size(1) + 1)
+  {
+    throw std::invalid_argument("the LM scores must be batch x (>= length + 1)");
+  }
+  if (outs.dtype != DType::Float32 && outs.dtype != DType::Float64)
+  {
+    throw std::invalid_argument("float outputs must be float32 or float64");
+  }
+}
+
+// Buffers of one search, kept per thread and reused across sentences (per sentence by BeamSession).
+struct BeamWorkspace
+{
+  // a search of length steps from scratch
+  void resize(int beam_width, int num_candidates, int length)
+  {
+    resize_step(beam_width, num_candidates);
+    cum_scores.assign(beam_width, 0);
+    backpointers.resize(length * beam_width);
+    tokens.resize(length * beam_width);
+    states.resize(beam_width);
+  }
+
+  // the buffers of a step, the beams are left as they are
+  void resize_step(int beam_width, int num_candidates)
+  {
+    tm_scores.resize(num_candidates);
+    candidates.resize(num_candidates);
+    words.resize(num_candidates);
+    lm_scores.resize(beam_width * num_candidates);
+    temp_scores.resize(beam_width * num_candidates);
+    idx.resize(beam_width);
+    order.resize(num_candidates);
+    bounds.resize(num_candidates);
+    beam_order.resize(beam_width);
+    best.reserve(beam_width);
+    out_states.resize(beam_width * num_candidates);
+  }
+
+  std::vector<float> tm_scores;      // log p_TM of the current step, shared by the beams
+  std::vector<int> candidates;       // MT indices of the current candidates
+  std::vector<lm::WordIndex> words;  // and their KenLM indices
+  std::vector<float> lm_scores;      // beam x candidates
+  std::vector<float> temp_scores;
+  std::vector<int> idx;
+  std::vector<float> cum_scores;
+
+  // pruned search: candidates and beams by decreasing TM / cumulative score,
+  // and the best fused scores of the step so far
+  std::vector<int> order;
+  std::vector<float> bounds;  // fusion_bound of order[i]
+  std::vector<int> beam_order;
+  std::vector<float> best;
+
+  // hypotheses are kept as a trellis of (parent beam, token) per time step,
+  // the prefixes are only traced back once the search is finished.
+  std::vector<int> backpointers;
+  std::vector<int> tokens;
+
+  // KenLM states
+  std::vector<State> states;
+  std::vector<State> out_states;
+};
+
+// The TM side of step t, the same for every beam: log p_TM and MT indices of the candidates, returns the gate.
+static inline float read_step(BeamWorkspace &ws,
+                              const TensorView &probs,
+                              const TensorView &seqs,
+                              const TensorView &gates,
+                              int64_t index,
+                              size_t t,
+                              const int num_candidates)
+{
+  probs.read_floats(probs.offset(index, t, 0), probs.strides[2], num_candidates, ws.tm_scores.data());
+  seqs.read_ints(seqs.offset(index, t, 0), seqs.strides[2], num_candidates, ws.candidates.data());
+  for (size_t c = 0; c < num_candidates; c++)
+  {
+    ws.tm_scores[c] = std::log(ws.tm_scores[c]);
+  }
+  return gates.get_float(gates.offset(index, t));
+}
+
+// Rank the final scores in ws.temp_scores[0, beam_width) and trace the n-best back into out_seqs, out_scores.
+static void trace_back(BeamWorkspace &ws,
+                       const TensorView &out_seqs,
+                       const TensorView &out_scores,
+                       const int beam_width,
+                       const int32_t length,
+                       int64_t index)
+{
+  select_topk(ws.temp_scores.data(), beam_width, beam_width, ws.idx.data());
+
+  for (size_t b = 0; b < beam_width; b++){
+    int hyp = ws.idx[b];
+    for (size_t t = length; t-- > 0;)
+    {
+      out_seqs.set_int(out_seqs.offset(index, t, b), ws.tokens[t * beam_width + hyp]);
+      hyp = ws.backpointers[t * beam_width + hyp];
+    }
+    out_scores.set_float(out_scores.offset(index, b), ws.temp_scores[ws.idx[b]]);
+  }
+}
+
+// Fused scores of the first max_width beams from ws.lm_scores, into ws.temp_scores.
+static inline void fuse_beams(BeamWorkspace &ws, const int type, const float gate, const int max_width,
+                              const int num_candidates)
+{
+  for (size_t b = 0; b < max_width; b++)
+  {
+    fuse_scores(type, ws.cum_scores[b], ws.tm_scores.data(), &ws.lm_scores[b * num_candidates], gate,
+                num_candidates, &ws.temp_scores[b * num_candidates]);
+  }
+}
+
+/* The new beams of the step-th step from ws.temp_scores: top-k, trellis row and
+ * cumulative scores, and the KenLM states of each of the models (one for a
+ * single LM), states[m * beam_width + b] taken from the beam x candidates
+ * slice out_states[m * beam_width * num_candidates, ...). */
+static void select_beams(BeamWorkspace &ws,
+                         size_t step,
+                         const int beam_width,
+                         const int num_candidates,
+                         const size_t models,
+                         State *states,
+                         const State *out_states,
+                         StageTimer &timer)
+{
+  if (step > 0){
+    select_topk(ws.temp_scores.data(), beam_width * num_candidates, beam_width, ws.idx.data());
+  } else{
+    std::iota(ws.idx.begin(), ws.idx.end(), 0);
+  }
+  timer.lap(&DecoderStats::topk_ns);
+
+  for (size_t b = 0; b < beam_width; b++)
+  {
+    ws.backpointers[step * beam_width + b] = ws.idx[b] / num_candidates;
+    ws.tokens[step * beam_width + b] = ws.candidates[ws.idx[b] % num_candidates];
+    ws.cum_scores[b] = ws.temp_scores[ws.idx[b]];
+  }
+  const size_t step_size = beam_width * num_candidates;
+  for (size_t m = 0; m < models; m++)
+  {
+    for (size_t b = 0; b < beam_width; b++)
+    {
+      states[m * beam_width + b] = out_states[m * step_size + ws.idx[b]];
+    }
+  }
+  timer.lap(&DecoderStats::reorder_ns);
+}
+
+// LM log probs of every (beam, candidate) pair of a step, lm_scores and out_states are beam x candidates.
+template <class Model>
+void _score_step_(Scorer *lm_scorer,
+                  const State *states,
+                  const int max_width,
+                  const lm::WordIndex *words,
+                  const int num_candidates,
+                  State *out_states,
+                  float *lm_scores,
+                  ScoreCache *cache,
+                  DecoderStats *stats)
+{
+  for (size_t b = 0; b < max_width; b++)
+  {
+    for (size_t c = 0; c < num_candidates; c++)
+    {
+      lm_scores[b * num_candidates + c] = lm_scorer->get_base_log_prob<Model>(
+        states[b], words[c], out_states[b * num_candidates + c], cache, stats);
+    }
+  }
+}
+
+/* Upper bound of the LM log prob (loge) of any word after state. KenLM's
+ * probabilities are <= 0 (positive ones are rejected or zeroed at load), only the
+ * backoffs of the contexts a query falls back from can raise it above. */
+static float max_log_prob(const State &state)
+{
+  float bound = 0;
+  for (unsigned char i = 0; i < state.length; i++)
+  {
+    bound += std::max(state.backoff[i], 0.0f);
+  }
+  return bound / NUM_FLT_LOGE;
+}
+
+/* Fills ws.temp_scores of one step like the exhaustive loops of _beam_search_,
+ * but only for the candidates that can still make the beam, the others get -inf
+ * and their LM score is never asked for.
+ *
+ * Candidates are visited by decreasing TM score, beams by decreasing cumulative
+ * score (after the first step the beams are not ranked), and fusion_bound only
+ * decreases along both, so the first candidate whose bound is below the k-th
+ * best score computed so far ends the beam, and ends the step when it is the
+ * first one of the beam. Candidates are looked up in blocks, each one up to
+ * the first failing bound against the threshold at its start. With prune_margin = 0 the step selects exactly what the exhaustive
+ * loops would; a positive margin also drops candidates that could only beat the
+ * k-th best score by less than that much.
+ *
+ * The first step keeps the first beam_width candidates of the short list
+ * whatever their scores, so only those are looked up. */
+template <class Model>
+void _score_pruned_(Scorer *lm_scorer,
+                    BeamWorkspace &ws,
+                    const size_t t,
+                    const int beam_width,
+                    const int num_candidates,
+                    const int type,
+                    const float gate,
+                    const float prune_margin,
+                    ScoreCache *cache,
+                    DecoderStats *stats)
+{
+  const int max_width = (t > 0) ? beam_width : 1;
+  std::fill(ws.temp_scores.begin(), ws.temp_scores.begin() + max_width * num_candidates, -INFINITY);
+
+  if (t == 0)
+  {
+    for (int c = 0; c < beam_width; c++)
+    {
+      const float lm_score = lm_scorer->get_base_log_prob<Model>(ws.states[0], ws.words[c], ws.out_states[c],
+                                                                 cache, stats);
+      fuse_scores(type, ws.cum_scores[0], &ws.tm_scores[c], &lm_score, gate, 1, &ws.temp_scores[c]);
+    }
+    if (stats != nullptr)
+    {
+      stats->lm_pruned += num_candidates - beam_width;
+    }
+    return;
+  }
+
+  // short lists usually come sorted from the TM's top-k
+  std::iota(ws.order.begin(), ws.order.end(), 0);
+  if (!std::is_sorted(ws.tm_scores.begin(), ws.tm_scores.end(), std::greater<float>()))
+  {
+    std::stable_sort(ws.order.begin(), ws.order.end(),
+                     [&ws](int a, int b) { return ws.tm_scores[a] > ws.tm_scores[b]; });
+  }
+  // 0 unless a context of the step has a positive backoff, one bound for all beams keeps them ordered
+  float lm_bound = 0;
+  for (int b = 0; b < beam_width; b++)
+  {
+    lm_bound = std::max(lm_bound, max_log_prob(ws.states[b]));
+  }
+  for (int i = 0; i < num_candidates; i++)
+  {
+    ws.bounds[i] = fusion_bound(type, ws.tm_scores[ws.order[i]], gate, lm_bound);
+  }
+  std::iota(ws.beam_order.begin(), ws.beam_order.end(), 0);
+  if (!std::is_sorted(ws.cum_scores.begin(), ws.cum_scores.end(), std::greater<float>()))
+  {
+    std::stable_sort(ws.beam_order.begin(), ws.beam_order.end(),
+                     [&ws](int a, int b) { return ws.cum_scores[a] > ws.cum_scores[b]; });
+  }
+
+  ws.best.clear();
+  uint64_t looked_up = 0;
+  for (int r = 0; r < beam_width; r++)
+  {
+    const int b = ws.beam_order[r];
+    const float cum_score = ws.cum_scores[b];
+    int begin = 0;
+    while (begin < num_candidates)
+    {
+      // the next block: enough candidates to fill the k best, then those whose bound clears the k-th best.
+      // the threshold is only raised between blocks, so that the lookups of a block do not wait on each other.
+      const int missing = beam_width - static_cast<int>(ws.best.size());
+      int end = begin;
+      if (missing > 0)
+      {
+        end = std::min(num_candidates, begin + missing);
+      }
+      else
+      {
+        const float threshold = ws.best.back();
+        while (end < num_candidates && !(cum_score + ws.bounds[end] - prune_margin < threshold))
+        {
+          end++;
+        }
+      }
+      if (end == begin)
+      {
+        break;
+      }
+
+      for (int i = begin; i < end; i++)
+      {
+        const int c = ws.order[i];
+        ws.lm_scores[b * num_candidates + c] = lm_scorer->get_base_log_prob<Model>(
+          ws.states[b], ws.words[c], ws.out_states[b * num_candidates + c], cache, stats);
+      }
+      for (int i = begin; i < end; i++)
+      {
+        const int j = b * num_candidates + ws.order[i];
+        fuse_scores(type, cum_score, &ws.tm_scores[ws.order[i]], &ws.lm_scores[j], gate, 1, &ws.temp_scores[j]);
+        const float score = ws.temp_scores[j];
+        if (static_cast<int>(ws.best.size()) < beam_width || score > ws.best.back())
+        {
+          if (static_cast<int>(ws.best.size()) == beam_width)
+          {
+            ws.best.pop_back();
+          }
+          ws.best.insert(std::upper_bound(ws.best.begin(), ws.best.end(), score, std::greater<float>()), score);
+        }
+      }
+      looked_up += end - begin;
+      begin = end;
+    }
+    if (begin == 0)
+    {
+      // the following beams have lower cumulative scores
+      break;
+    }
+  }
+  if (stats != nullptr)
+  {
+    stats->lm_pruned += static_cast<uint64_t>(beam_width) * num_candidates - looked_up;
+  }
+}
+
+/* One time step of the search: the candidates at step t of the views extend
+ * the beams in ws, as the step-th step of the search (the first one starts
+ * from the single beam of <s>, ws.states[0]). The trellis must hold step + 1 rows. */
+template <class Model>
+void _beam_step_(Scorer *lm_scorer,
+                 BeamWorkspace &ws,
+                 const TensorView &probs,
+                 const TensorView &seqs,
+                 const TensorView &gates,
+                 int64_t index,
+                 size_t t,
+                 size_t step,
+                 const int beam_width,
+                 const int type,
+                 ScoreCache *cache,
+                 DecoderStats *stats,
+                 const float prune_margin,
+                 StageTimer &timer)
+{
+  const int32_t num_candidates = probs.size(2);
+
+  const float gate = read_step(ws, probs, seqs, gates, index, t, num_candidates);
+  for (size_t c = 0; c < num_candidates; c++)
+  {
+    ws.words[c] = lm_scorer->get_word_index(ws.candidates[c]);
+  }
+  timer.lap(&DecoderStats::read_ns);
+
+  if (prune_margin >= 0 && (type == 0 || type == 1) && gate >= 0 && gate <= 1)
+  {
+    // lookups and fusion are interleaved, both are timed as lm_ns
+    _score_pruned_<Model>(lm_scorer, ws, step, beam_width, num_candidates, type, gate, prune_margin, cache, stats);
+    timer.lap(&DecoderStats::lm_ns);
+  }
+  else
+  {
+    int max_width = (step > 0) ? beam_width : 1;
+    _score_step_<Model>(lm_scorer, ws.states.data(), max_width, ws.words.data(), num_candidates,
+                        ws.out_states.data(), ws.lm_scores.data(), cache, stats);
+    timer.lap(&DecoderStats::lm_ns);
+    fuse_beams(ws, type, gate, max_width, num_candidates);
+    timer.lap(&DecoderStats::fuse_ns);
+  }
+
+  select_beams(ws, step, beam_width, num_candidates, 1, ws.states.data(), ws.out_states.data(), timer);
+}
+
+// Adds </s> to the beams in ws after length steps and writes the n-best of the index-th sentence.
+template <class Model>
+void _beam_finish_(Scorer *lm_scorer,
+                   BeamWorkspace &ws,
+                   const TensorView &out_seqs,
+                   const TensorView &out_scores,
+                   const int beam_width,
+                   const int32_t length,
+                   int64_t index,
+                   ScoreCache *cache,
+                   DecoderStats *stats)
+{
+  // final sort rank again with the final score
+  for (size_t b = 0; b < beam_width; b++){
+    ws.temp_scores[b] = ws.cum_scores[b] + lm_scorer->get_end_log_prob<Model>(ws.states[b], ws.out_states[b], cache, stats);
+  }
+
+  trace_back(ws, out_seqs, out_scores, beam_width, length, index);
+}
+
+template <class Model>
+void _beam_search_(Scorer *lm_scorer,
+                   const TensorView &probs,
+                   const TensorView &seqs,
+                   const TensorView &gates,
+                   const TensorView &lens,
+                   const TensorView &out_seqs,
+                   const TensorView &out_scores,
+                   const int beam_width,
+                   int64_t index,
+                   const int type,
+                   ScoreCache *cache,
+                   DecoderStats *stats,
+                   const float prune_margin)
+{
+  // type = 0: mixture of experts: log( \alpha * p_TM + (1 - \alpha) * p_LM )
+  // type = 1: shallow fusion: \alpha * log p_TM + (1 - \alpha) * log p_LM (as scores)
+  // type = 2: simple fusion: log( softmax(\alpha * TM_scores + (1 - \alpha) * log p_LM (as scores)))
+  // prune_margin >= 0 skips LM lookups that cannot change the beams (see _score_pruned_), for types 0 and 1 only:
+  // the softmax of type 2 needs the scores of every candidate.
+
+  const int32_t num_candidates = probs.size(2);
+  const int32_t length = get_length(lens, index);
+
+  static thread_local BeamWorkspace ws;
+  ws.resize(beam_width, num_candidates, length);
+
+  // start the language model, every beam from <s> in case the sentence is empty.
+  lm_scorer->start(ws.states[0]);
+  std::fill(ws.states.begin() + 1, ws.states.end(), ws.states[0]);
+  StageTimer timer(stats);
+
+  for (size_t t = 0; t < length; t++)
+  {
+    _beam_step_<Model>(lm_scorer, ws, probs, seqs, gates, index, t, t, beam_width, type, cache, stats, prune_margin,
+                       timer);
+  }
+  _beam_finish_<Model>(lm_scorer, ws, out_seqs, out_scores, beam_width, length, index, cache, stats);
+  timer.lap(&DecoderStats::finish_ns);
+}
+
+typedef void (*beam_search_fn)(Scorer *,
+                               const TensorView &, const TensorView &, const TensorView &, const TensorView &,
+                               const TensorView &, const TensorView &,
+                               const int, int64_t, const int, ScoreCache *, DecoderStats *, const float);
+
+struct BeamSearchDispatch
+{
+  template <class Model>
+  static beam_search_fn apply() { return &_beam_search_<Model>; }
+};
+
+std::shared_ptr<WorkerPool::Job> submit_beam_search(Scorer *lm_scorer,
+                                                    WorkerPool *pool,
+                                                    const TensorView &probs,
+                                                    const TensorView &seqs,
+                                                    const TensorView &gates,
+                                                    const TensorView &lens,
+                                                    const TensorView &out_seqs,
+                                                    const TensorView &out_scores,
+                                                    const int beam_width,
+                                                    const int type,
+                                                    const float prune_margin)
+{
+  check_candidates(probs, seqs, gates, lens, beam_width);
+  check_nbest(out_seqs, out_scores, probs.size(0), probs.size(1), beam_width);
+  const int64_t batch_size = probs.size(0);
+  beam_search_fn search = dispatch_model<BeamSearchDispatch>(lm_scorer);
+  const std::vector<int64_t> order = longest_first(lens, batch_size);
+
+  const uint64_t submitted = stats_clock();
+
+  // the job may outlive this call, everything is captured by value
+  return pool->submit(batch_size, 0, [=](size_t worker, size_t begin, size_t end) {
+    DecoderStats *stats = lm_scorer->get_stats(worker);
+    if (stats != nullptr)
+    {
+      stats->queue_ns += stats_clock() - submitted;
+    }
+    for (size_t i = begin; i < end; i++)
+    {
+      const uint64_t start = stats ? stats_clock() : 0;
+      search(lm_scorer, probs, seqs, gates, lens, out_seqs, out_scores, beam_width, order[i], type,
+             lm_scorer->get_cache(worker), stats, prune_margin);
+      if (stats != nullptr)
+      {
+        stats->add_sentence(get_length(lens, order[i]), stats_clock() - start);
+      }
+    }
+  });
+}
+
+void beam_search_batch(Scorer *lm_scorer,
+                       WorkerPool *pool,
+                       const TensorView &probs,
+                       const TensorView &seqs,
+                       const TensorView &gates,
+                       const TensorView &lens,
+                       const TensorView &out_seqs,
+                       const TensorView &out_scores,
+                       const int beam_width,
+                       const int type,
+                       const float prune_margin)
+{
+  submit_beam_search(lm_scorer, pool, probs, seqs, gates, lens, out_seqs, out_scores, beam_width, type,
+                     prune_margin)->wait();
+}
+
+template <class Model>
+void _get_kenlm_scores_(Scorer *lm_scorer,
+                        const TensorView &seqs,
+                        const TensorView &lens,
+                        const TensorView &outs,
+                        int64_t index,
+                        ScoreCache *cache,
+                        DecoderStats *stats)
+{
+  const int32_t length = get_length(lens, index);
+
+  State state, out_state, tmp_state;
+  StageTimer timer(stats);
+
+  lm_scorer->start(state);
+  for (size_t t = 0; t < length; t++)
+  {
+    const int word = static_cast<int>(seqs.get_int(seqs.offset(index, t)));
+    outs.set_float(outs.offset(index, t), lm_scorer->get_index_log_prob<Model>(state, word, out_state, cache, stats));
+
+    // make sure pointers are not mixed
+    tmp_state = state;
+    state = out_state;
+    out_state = tmp_state;
+  }
+  outs.set_float(outs.offset(index, length), lm_scorer->get_end_log_prob<Model>(state, out_state, cache, stats));
+  timer.lap(&DecoderStats::score_ns);
+}
+
+typedef void (*kenlm_scores_fn)(Scorer *, const TensorView &, const TensorView &, const TensorView &,
+                                int64_t, ScoreCache *, DecoderStats *);
+
+struct KenLMScoresDispatch
+{
+  template <class Model>
+  static kenlm_scores_fn apply() { return &_get_kenlm_scores_<Model>; }
+};
+
+void kenlm_scores_batch(Scorer *lm_scorer,
+                        WorkerPool *pool,
+                        const TensorView &seqs,
+                        const TensorView &lens,
+                        const TensorView &outs)
+{
+  check_score_inputs(seqs, lens, outs);
+  const int64_t batch_size = seqs.size(0);
+  kenlm_scores_fn score = dispatch_model<KenLMScoresDispatch>(lm_scorer);
+  const std::vector<int64_t> order = longest_first(lens, batch_size);
+
+  pool->parallel_for(batch_size, 0, [&](size_t worker, size_t begin, size_t end) {
+    for (size_t i = begin; i < end; i++)
+    {
+      score(lm_scorer, seqs, lens, outs, order[i], lm_scorer->get_cache(worker), lm_scorer->get_stats(worker));
+    }
+  });
+}
+
+void beam_search_sentence(Scorer *lm_scorer,
+                          const TensorView &probs,
+                          const TensorView &seqs,
+                          const TensorView &gates,
+                          const TensorView &lens,
+                          const TensorView &out_seqs,
+                          const TensorView &out_scores,
+                          const int beam_width,
+                          int64_t index,
+                          const int type,
+                          ScoreCache *cache,
+                          DecoderStats *stats,
+                          const float prune_margin)
+{
+  check_candidates(probs, seqs, gates, lens, beam_width);
+  check_nbest(out_seqs, out_scores, probs.size(0), probs.size(1), beam_width);
+  beam_search_fn search = dispatch_model<BeamSearchDispatch>(lm_scorer);
+  search(lm_scorer, probs, seqs, gates, lens, out_seqs, out_scores, beam_width, index, type, cache, stats,
+         prune_margin);
+}
+
+void kenlm_scores_sentence(Scorer *lm_scorer,
+                           const TensorView &seqs,
+                           const TensorView &lens,
+                           const TensorView &outs,
+                           int64_t index,
+                           ScoreCache *cache,
+                           DecoderStats *stats)
+{
+  check_score_inputs(seqs, lens, outs);
+  kenlm_scores_fn score = dispatch_model<KenLMScoresDispatch>(lm_scorer);
+  score(lm_scorer, seqs, lens, outs, index, cache, stats);
+}
+
+// The steps of one sentence of a BeamSession: steps [0, length) of the views continue its beams after done steps.
+template <class Model>
+void _session_step_(Scorer *lm_scorer,
+                    BeamWorkspace &ws,
+                    const TensorView &probs,
+                    const TensorView &seqs,
+                    const TensorView &gates,
+                    int64_t index,
+                    const int32_t length,
+                    const int32_t done,
+                    const int beam_width,
+                    const int type,
+                    ScoreCache *cache,
+                    DecoderStats *stats,
+                    const float prune_margin)
+{
+  ws.resize_step(beam_width, probs.size(2));
+  ws.backpointers.resize((done + length) * beam_width);
+  ws.tokens.resize((done + length) * beam_width);
+  StageTimer timer(stats);
+
+  for (int32_t t = 0; t < length; t++)
+  {
+    _beam_step_<Model>(lm_scorer, ws, probs, seqs, gates, index, t, done + t, beam_width, type, cache, stats,
+                       prune_margin, timer);
+  }
+}
+
+typedef void (*session_step_fn)(Scorer *, BeamWorkspace &, const TensorView &, const TensorView &,
+                                const TensorView &, int64_t, const int32_t, const int32_t, const int, const int,
+                                ScoreCache *, DecoderStats *, const float);
+typedef void (*beam_finish_fn)(Scorer *, BeamWorkspace &, const TensorView &, const TensorView &, const int,
+                               const int32_t, int64_t, ScoreCache *, DecoderStats *);
+
+struct SessionStepDispatch
+{
+  template <class Model>
+  static session_step_fn apply() { return &_session_step_<Model>; }
+};
+
+struct BeamFinishDispatch
+{
+  template <class Model>
+  static beam_finish_fn apply() { return &_beam_finish_<Model>; }
+};
+
+BeamSession::BeamSession(Scorer *scorer, int beam_width, int type, float prune_margin)
+    : scorer_(scorer), beam_width_(beam_width), type_(type), prune_margin_(prune_margin)
+{
+  if (beam_width < 1)
+  {
+    throw std::invalid_argument("beam_width must be at least 1");
+  }
+}
+
+BeamSession::~BeamSession() {}
+
+void BeamSession::init(int64_t batch_size)
+{
+  while (static_cast<int64_t>(beams_.size()) < batch_size)
+  {
+    beams_.emplace_back(new BeamWorkspace());
+  }
+  lengths_.assign(batch_size, 0);
+  busy_ns_.assign(batch_size, 0);
+  recorded_.assign(batch_size, -1);
+
+  for (int64_t i = 0; i < batch_size; i++)
+  {
+    BeamWorkspace &ws = *beams_[i];
+    ws.resize(beam_width_, beam_width_, 0);  // finalize() needs beam_width entries even without steps
+    scorer_->start(ws.states[0]);
+    std::fill(ws.states.begin() + 1, ws.states.end(), ws.states[0]);
+  }
+}
+
+void BeamSession::step(WorkerPool *pool,
+                       const TensorView &probs,
+                       const TensorView &seqs,
+                       const TensorView &gates,
+                       const TensorView &lens)
+{
+  const int64_t batch_size = probs.size(0);
+  if (batch_size != get_batch_size())
+  {
+    throw std::invalid_argument("the steps must be given for the batch the session was initialized with");
+  }
+  check_candidates(probs, seqs, gates, lens, beam_width_);
+  session_step_fn search = dispatch_model<SessionStepDispatch>(scorer_);
+
+  Scorer *lm_scorer = scorer_;
+  pool->parallel_for(batch_size, 0, [&](size_t worker, size_t begin, size_t end) {
+    DecoderStats *stats = lm_scorer->get_stats(worker);
+    for (size_t i = begin; i < end; i++)
+    {
+      const uint64_t start = stats ? stats_clock() : 0;
+      const int32_t length = get_length(lens, i);
+      search(lm_scorer, *beams_[i], probs, seqs, gates, i, length, lengths_[i], beam_width_, type_,
+             lm_scorer->get_cache(worker), stats, prune_margin_);
+      lengths_[i] += length;
+      if (stats != nullptr)
+      {
+        busy_ns_[i] += stats_clock() - start;
+      }
+    }
+  });
+}
+
+void BeamSession::finalize(WorkerPool *pool, const TensorView &out_seqs, const TensorView &out_scores)
+{
+  check_nbest(out_seqs, out_scores, get_batch_size(), get_max_length(), beam_width_);
+  beam_finish_fn finish = dispatch_model<BeamFinishDispatch>(scorer_);
+
+  Scorer *lm_scorer = scorer_;
+  pool->parallel_for(get_batch_size(), 0, [&](size_t worker, size_t begin, size_t end) {
+    DecoderStats *stats = lm_scorer->get_stats(worker);
+    for (size_t i = begin; i < end; i++)
+    {
+      const uint64_t start = stats ? stats_clock() : 0;
+      StageTimer timer(stats);
+      finish(lm_scorer, *beams_[i], out_seqs, out_scores, beam_width_, lengths_[i], i,
+             lm_scorer->get_cache(worker), stats);
+      timer.lap(&DecoderStats::finish_ns);
+      if (stats != nullptr)
+      {
+        const uint64_t elapsed = busy_ns_[i] + stats_clock() - start;
+        if (recorded_[i] < 0)
+        {
+          stats->add_sentence(lengths_[i], elapsed);
+        }
+        else
+        {
+          // finalized before: only the steps and time since then, the sentence is already counted
+          stats->tokens += lengths_[i] - recorded_[i];
+          stats->decode_ns += elapsed;
+        }
+        recorded_[i] = lengths_[i];
+        busy_ns_[i] = 0;
+      }
+    }
+  });
+}
+
+int32_t BeamSession::get_max_length() const
+{
+  return lengths_.empty() ? 0 : *std::max_element(lengths_.begin(), lengths_.end());
+}
+
+// </s> after each beam for one model of an ensemble
+template <class Model>
+void _score_end_(Scorer *lm_scorer,
+                 const State *states,
+                 const int beam_width,
+                 State *out_states,
+                 float *lm_scores,
+                 ScoreCache *cache,
+                 DecoderStats *stats)
+{
+  for (size_t b = 0; b < beam_width; b++)
+  {
+    lm_scores[b] = lm_scorer->get_end_log_prob<Model>(states[b], out_states[b], cache, stats);
+  }
+}
+
+// per-token log probs of the index-th sentence (and </s>) for one model of an ensemble
+template <class Model>
+void _score_sentence_(Scorer *lm_scorer,
+                      const TensorView &seqs,
+                      int64_t index,
+                      const int32_t length,
+                      float *lm_scores,
+                      ScoreCache *cache,
+                      DecoderStats *stats)
+{
+  State state, out_state;
+  lm_scorer->start(state);
+  for (size_t t = 0; t < length; t++)
+  {
+    const int word = static_cast<int>(seqs.get_int(seqs.offset(index, t)));
+    lm_scores[t] = lm_scorer->get_index_log_prob<Model>(state, word, out_state, cache, stats);
+    state = out_state;
+  }
+  lm_scores[length] = lm_scorer->get_end_log_prob<Model>(state, out_state, cache, stats);
+}
+
+typedef void (*score_step_fn)(Scorer *, const State *, const int, const lm::WordIndex *, const int, State *,
+                              float *, ScoreCache *, DecoderStats *);
+typedef void (*score_end_fn)(Scorer *, const State *, const int, State *, float *, ScoreCache *, DecoderStats *);
+typedef void (*score_sentence_fn)(Scorer *, const TensorView &, int64_t, const int32_t, float *, ScoreCache *,
+                                  DecoderStats *);
+
+// the lookups of each model instantiated for its own KenLM model type
+struct EnsembleKernels
+{
+  explicit EnsembleKernels(const Ensemble *ensemble)
+  {
+    for (size_t m = 0; m < ensemble->size(); m++)
+    {
+      dispatch_model<EnsembleKernels>(ensemble->get_scorer(m), *this);
+    }
+  }
+
+  template <class Model>
+  static void apply(EnsembleKernels &kernels)
+  {
+    kernels.step.push_back(&_score_step_<Model>);
+    kernels.end.push_back(&_score_end_<Model>);
+    kernels.sentence.push_back(&_score_sentence_<Model>);
+  }
+
+  std::vector<score_step_fn> step;
+  std::vector<score_end_fn> end;
+  std::vector<score_sentence_fn> sentence;
+};
+
+// The per-model side of an ensemble search: parallel arrays with one slice per model.
+struct EnsembleWorkspace : BeamWorkspace
+{
+  void resize_models(size_t models, int beam_width, int num_candidates)
+  {
+    model_words.resize(models * num_candidates);
+    model_states.resize(models * beam_width);
+    model_out_states.resize(models * beam_width * num_candidates);
+    model_scores.resize(models * beam_width * num_candidates);
+  }
+
+  std::vector<lm::WordIndex> model_words;  // model x candidates
+  std::vector<State> model_states;         // model x beam
+  std::vector<State> model_out_states;     // model x beam x candidates
+  std::vector<float> model_scores;         // model x beam x candidates
+};
+
+// _beam_search_ with the LM scores of several models combined by the ensemble, without pruning.
+void _beam_search_ensemble_(const Ensemble *ensemble,
+                            const EnsembleKernels &kernels,
+                            const TensorView &probs,
+                            const TensorView &seqs,
+                            const TensorView &gates,
+                            const TensorView &lens,
+                            const TensorView &out_seqs,
+                            const TensorView &out_scores,
+                            const int beam_width,
+                            int64_t index,
+                            const int type,
+                            size_t worker)
+{
+  const size_t models = ensemble->size();
+  const int32_t num_candidates = probs.size(2);
+  const int32_t length = get_length(lens, index);
+  const size_t step_size = beam_width * num_candidates;
+
+  static thread_local EnsembleWorkspace ws;
+  ws.resize(beam_width, num_candidates, length);
+  ws.resize_models(models, beam_width, num_candidates);
+
+  // start each model, every beam from <s> in case the sentence is empty.
+  for (size_t m = 0; m < models; m++)
+  {
+    State *states = &ws.model_states[m * beam_width];
+    ensemble->get_scorer(m)->start(states[0]);
+    std::fill(states + 1, states + beam_width, states[0]);
+  }
+  // stage times are kept by the first model
+  StageTimer timer(ensemble->get_scorer(0)->get_stats(worker));
+
+  for (size_t t = 0; t < length; t++)
+  {
+    const float gate = read_step(ws, probs, seqs, gates, index, t, num_candidates);
+    for (size_t m = 0; m < models; m++)
+    {
+      Scorer *lm_scorer = ensemble->get_scorer(m);
+      for (size_t c = 0; c < num_candidates; c++)
+      {
+        ws.model_words[m * num_candidates + c] = lm_scorer->get_word_index(ws.candidates[c]);
+      }
+    }
+    timer.lap(&DecoderStats::read_ns);
+
+    const int max_width = (t > 0) ? beam_width : 1;
+    for (size_t m = 0; m < models; m++)
+    {
+      Scorer *lm_scorer = ensemble->get_scorer(m);
+      kernels.step[m](lm_scorer, &ws.model_states[m * beam_width], max_width, &ws.model_words[m * num_candidates],
+                      num_candidates, &ws.model_out_states[m * step_size], &ws.model_scores[m * step_size],
+                      lm_scorer->get_cache(worker), lm_scorer->get_stats(worker));
+    }
+    for (size_t j = 0; j < max_width * num_candidates; j++)
+    {
+      ws.lm_scores[j] = ensemble->combine(&ws.model_scores[j], step_size);
+    }
+    timer.lap(&DecoderStats::lm_ns);
+    fuse_beams(ws, type, gate, max_width, num_candidates);
+    timer.lap(&DecoderStats::fuse_ns);
+
+    select_beams(ws, t, beam_width, num_candidates, models, ws.model_states.data(), ws.model_out_states.data(),
+                 timer);
+  }
+
+  for (size_t m = 0; m < models; m++)
+  {
+    Scorer *lm_scorer = ensemble->get_scorer(m);
+    kernels.end[m](lm_scorer, &ws.model_states[m * beam_width], beam_width, &ws.model_out_states[m * step_size],
+                   &ws.model_scores[m * step_size], lm_scorer->get_cache(worker), lm_scorer->get_stats(worker));
+  }
+  for (size_t b = 0; b < beam_width; b++)
+  {
+    ws.temp_scores[b] = ws.cum_scores[b] + ensemble->combine(&ws.model_scores[b], step_size);
+  }
+  trace_back(ws, out_seqs, out_scores, beam_width, length, index);
+  timer.lap(&DecoderStats::finish_ns);
+}
+
+std::shared_ptr<WorkerPool::Job> submit_beam_search_ensemble(Ensemble *ensemble,
+                                                             WorkerPool *pool,
+                                                             const TensorView &probs,
+                                                             const TensorView &seqs,
+                                                             const TensorView &gates,
+                                                             const TensorView &lens,
+                                                             const TensorView &out_seqs,
+                                                             const TensorView &out_scores,
+                                                             const int beam_width,
+                                                             const int type)
+{
+  check_candidates(probs, seqs, gates, lens, beam_width);
+  check_nbest(out_seqs, out_scores, probs.size(0), probs.size(1), beam_width);
+  const int64_t batch_size = probs.size(0);
+  const EnsembleKernels kernels(ensemble);
+  const std::vector<int64_t> order = longest_first(lens, batch_size);
+
+  const uint64_t submitted = stats_clock();
+
+  return pool->submit(batch_size, 0, [=](size_t worker, size_t begin, size_t end) {
+    DecoderStats *stats = ensemble->get_scorer(0)->get_stats(worker);
+    if (stats != nullptr)
+    {
+      stats->queue_ns += stats_clock() - submitted;
+    }
+    for (size_t i = begin; i < end; i++)
+    {
+      const uint64_t start = stats ? stats_clock() : 0;
+      _beam_search_ensemble_(ensemble, kernels, probs, seqs, gates, lens, out_seqs, out_scores, beam_width,
+                             order[i], type, worker);
+      if (stats != nullptr)
+      {
+        stats->add_sentence(get_length(lens, order[i]), stats_clock() - start);
+      }
+    }
+  });
+}
+
+void beam_search_ensemble_batch(Ensemble *ensemble,
+                                WorkerPool *pool,
+                                const TensorView &probs,
+                                const TensorView &seqs,
+                                const TensorView &gates,
+                                const TensorView &lens,
+                                const TensorView &out_seqs,
+                                const TensorView &out_scores,
+                                const int beam_width,
+                                const int type)
+{
+  submit_beam_search_ensemble(ensemble, pool, probs, seqs, gates, lens, out_seqs, out_scores, beam_width,
+                              type)->wait();
+}
+
+void kenlm_scores_ensemble_batch(Ensemble *ensemble,
+                                 WorkerPool *pool,
+                                 const TensorView &seqs,
+                                 const TensorView &lens,
+                                 const TensorView &outs)
+{
+  check_score_inputs(seqs, lens, outs);
+  const int64_t batch_size = seqs.size(0);
+  const size_t models = ensemble->size();
+  const EnsembleKernels kernels(ensemble);
+  const std::vector<int64_t> order = longest_first(lens, batch_size);
+
+  pool->parallel_for(batch_size, 0, [&](size_t worker, size_t begin, size_t end) {
+    static thread_local std::vector<float> scores;  // model x (length + 1)
+    for (size_t i = begin; i < end; i++)
+    {
+      StageTimer timer(ensemble->get_scorer(0)->get_stats(worker));
+      const int32_t length = get_length(lens, order[i]);
+      const size_t stride = length + 1;
+      scores.resize(models * stride);
+      for (size_t m = 0; m < models; m++)
+      {
+        Scorer *lm_scorer = ensemble->get_scorer(m);
+        kernels.sentence[m](lm_scorer, seqs, order[i], length, &scores[m * stride], lm_scorer->get_cache(worker),
+                            lm_scorer->get_stats(worker));
+      }
+      for (size_t t = 0; t <= length; t++)
+      {
+        outs.set_float(outs.offset(order[i], t), ensemble->combine(&scores[t], stride));
+      }
+      timer.lap(&DecoderStats::score_ns);
+    }
+  });
+}
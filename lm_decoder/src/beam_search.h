@@ -0,0 +1,177 @@
+#ifndef BEAM_SEARCH_H_
+#define BEAM_SEARCH_H_
+
+#include <memory>
+#include <vector>
+
+#include "ensemble.h"
+#include "kenlm_scorer.h"
+#include "tensor_view.h"
+#include "worker_pool.h"
+
+/* Batch entry points of the decoder, independent of torch.
+ *
+ * beam_search_batch:
+ *   probs:       batch x length x short_list, TM probabilities of the candidates (any float type)
+ *   seqs:        batch x length x short_list, MT vocabulary indices of the candidates (int32 / int64)
+ *   gates:       batch x length, fusion weight of the TM (any float type)
+ *   lens:        batch lengths, or a batch x length mask
+ *   out_seqs:    batch x length x (>= beam_width), receives the n-best (may alias seqs)
+ *   out_scores:  batch x beam_width, receives their scores (float32 / float64)
+ *   prune_margin: < 0 scores every candidate; >= 0 skips the LM lookups of candidates that cannot
+ *                make the beams (types 0 and 1), 0 keeps the results exact, more prunes further
+ *   beam_width must be in [1, short_list] and the shapes must match the above, std::invalid_argument
+ *   is thrown before any work otherwise
+ *
+ * kenlm_scores_batch:
+ *   seqs:        batch x length
+ *   lens:        batch lengths, or a batch x length mask
+ *   outs:        batch x (length + 1), receives the per-token LM log probs (float32 / float64)
+ */
+
+// lengths are either given directly (1-d) or as the number of non-zero mask entries (2-d)
+inline int32_t get_length(const TensorView &lens, int64_t index)
+{
+  if (lens.dim == 1)
+  {
+    return static_cast<int32_t>(lens.get_int(lens.offset(index)));
+  }
+  return static_cast<int32_t>(lens.count_nonzero(index));
+}
+
+// throw std::invalid_argument unless seqs, lens and outs fit together as for kenlm_scores_batch
+void check_score_inputs(const TensorView &seqs, const TensorView &lens, const TensorView &outs);
+
+void beam_search_batch(Scorer *lm_scorer,
+                       WorkerPool *pool,
+                       const TensorView &probs,
+                       const TensorView &seqs,
+                       const TensorView &gates,
+                       const TensorView &lens,
+                       const TensorView &out_seqs,
+                       const TensorView &out_scores,
+                       const int beam_width,
+                       const int type,
+                       const float prune_margin = -1);
+
+// same as beam_search_batch but returns as soon as the batch is queued on the pool.
+// several batches may be outstanding on one scorer; the views must stay valid until the job is done.
+std::shared_ptr<WorkerPool::Job> submit_beam_search(Scorer *lm_scorer,
+                                                    WorkerPool *pool,
+                                                    const TensorView &probs,
+                                                    const TensorView &seqs,
+                                                    const TensorView &gates,
+                                                    const TensorView &lens,
+                                                    const TensorView &out_seqs,
+                                                    const TensorView &out_scores,
+                                                    const int beam_width,
+                                                    const int type,
+                                                    const float prune_margin = -1);
+
+void kenlm_scores_batch(Scorer *lm_scorer,
+                        WorkerPool *pool,
+                        const TensorView &seqs,
+                        const TensorView &lens,
+                        const TensorView &outs);
+
+// the same over an ensemble of models, whose combined log probs take the place of the LM's (no pruning)
+void beam_search_ensemble_batch(Ensemble *ensemble,
+                                WorkerPool *pool,
+                                const TensorView &probs,
+                                const TensorView &seqs,
+                                const TensorView &gates,
+                                const TensorView &lens,
+                                const TensorView &out_seqs,
+                                const TensorView &out_scores,
+                                const int beam_width,
+                                const int type);
+
+std::shared_ptr<WorkerPool::Job> submit_beam_search_ensemble(Ensemble *ensemble,
+                                                             WorkerPool *pool,
+                                                             const TensorView &probs,
+                                                             const TensorView &seqs,
+                                                             const TensorView &gates,
+                                                             const TensorView &lens,
+                                                             const TensorView &out_seqs,
+                                                             const TensorView &out_scores,
+                                                             const int beam_width,
+                                                             const int type);
+
+void kenlm_scores_ensemble_batch(Ensemble *ensemble,
+                                 WorkerPool *pool,
+                                 const TensorView &seqs,
+                                 const TensorView &lens,
+                                 const TensorView &outs);
+
+/* Beam search over candidates that arrive a few time steps at a time, e.g.
+ * from semi-autoregressive or blockwise decoders.
+ *
+ * init() starts every sentence of a batch from <s>, each step() extends the
+ * beams with the next chunk of steps, and finalize() adds </s> and writes the
+ * n-best: the same result as beam_search_batch over all the steps at once.
+ * finalize() leaves the beams as they are, so it may also be called for the
+ * n-best so far and be followed by more steps; the decoding statistics count
+ * each sentence once, at its first finalize().
+ *
+ * The beams (scores, KenLM states and trellis) and the step buffers of every
+ * sentence are kept in the session and never shrink, so later steps and
+ * batches reuse them. One session must not be used by two calls at once. */
+struct BeamWorkspace;
+
+class BeamSession {
+
+public:
+  // type and prune_margin as for beam_search_batch, std::invalid_argument if beam_width < 1
+  BeamSession(Scorer *scorer, int beam_width, int type, float prune_margin = -1);
+  ~BeamSession();
+
+  // start batch_size sentences from <s>
+  void init(int64_t batch_size);
+
+  // probs, seqs: batch x steps x short_list, gates: batch x steps,
+  // lens: how many of these steps belong to each sentence (lengths or mask, as for beam_search_batch)
+  void step(WorkerPool *pool, const TensorView &probs, const TensorView &seqs, const TensorView &gates,
+            const TensorView &lens);
+
+  // out_seqs: batch x (>= get_max_length()) x (>= beam_width), out_scores: batch x beam_width
+  void finalize(WorkerPool *pool, const TensorView &out_seqs, const TensorView &out_scores);
+
+  int64_t get_batch_size() const { return lengths_.size(); }
+  int32_t get_max_length() const;
+
+private:
+  Scorer *scorer_;
+  int beam_width_;
+  int type_;
+  float prune_margin_;
+
+  std::vector<std::unique_ptr<BeamWorkspace>> beams_;  // per sentence, only ever grown
+  std::vector<int32_t> lengths_;                       // steps taken by each sentence
+  std::vector<uint64_t> busy_ns_;                      // time spent on each one, with decoding statistics
+  std::vector<int32_t> recorded_;                      // steps of each one in the statistics, -1 before finalize()
+};
+
+// decode / score only the index-th sentence of the batch, on the calling thread
+void beam_search_sentence(Scorer *lm_scorer,
+                          const TensorView &probs,
+                          const TensorView &seqs,
+                          const TensorView &gates,
+                          const TensorView &lens,
+                          const TensorView &out_seqs,
+                          const TensorView &out_scores,
+                          const int beam_width,
+                          int64_t index,
+                          const int type,
+                          ScoreCache *cache,
+                          DecoderStats *stats = nullptr,
+                          const float prune_margin = -1);
+
+void kenlm_scores_sentence(Scorer *lm_scorer,
+                           const TensorView &seqs,
+                           const TensorView &lens,
+                           const TensorView &outs,
+                           int64_t index,
+                           ScoreCache *cache,
+                           DecoderStats *stats = nullptr);
+
+#endif  // BEAM_SEARCH_H_
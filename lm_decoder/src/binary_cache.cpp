@@ -0,0 +1,280 @@
+#include "binary_cache.h"
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <stdexcept>
+#include <vector>
+
+#include "lm/config.hh"
+#include "lm/filter/arpa_io.hh"
+#include "lm/filter/format.hh"
+#include "lm/filter/vocab.hh"
+#include "lm/filter/wrapper.hh"
+#include "lm/model.hh"
+#include "lm/read_arpa.hh"
+#include "util/file.hh"
+#include "util/file_piece.hh"
+#include "util/murmur_hash.hh"
+
+using namespace lm::ngram;
+
+static const char *binary_type_name(ModelType type)
+{
+  switch (type)
+  {
+  case PROBING:
+    return "probing";
+  case TRIE:
+    return "trie";
+  case QUANT_TRIE:
+    return "quant_trie";
+  default:
+    throw std::invalid_argument("ARPA models are compiled to probing, trie or quant_trie binaries");
+  }
+}
+
+// bytes of a model of this type holding counts n-grams, as KenLM allocates them
+static uint64_t model_bytes(ModelType type, const std::vector<uint64_t> &counts)
+{
+  switch (type)
+  {
+  case PROBING:
+    return ProbingModel::Size(counts);
+  case TRIE:
+    return TrieModel::Size(counts);
+  default:
+    return QuantTrieModel::Size(counts);
+  }
+}
+
+static uint64_t sum(const std::vector<uint64_t> &counts)
+{
+  uint64_t total = 0;
+  for (uint64_t count : counts)
+  {
+    total += count;
+  }
+  return total;
+}
+
+// MurmurHash of the file in 1 MB chunks, each one seeded with the hash of the previous ones
+static uint64_t hash_file(const std::string &path)
+{
+  util::scoped_fd fd(util::OpenReadOrThrow(path.c_str()));
+  std::vector<char> buffer(1 << 20);
+  uint64_t hash = 0;
+  std::size_t got;
+  while ((got = util::ReadOrEOF(fd.get(), buffer.data(), buffer.size())) > 0)
+  {
+    hash = util::MurmurHashNative(buffer.data(), got, hash);
+  }
+  return hash;
+}
+
+// the same over the sorted distinct words, each one with its terminating '\0'
+static uint64_t hash_words(std::vector<std::string> words)
+{
+  std::sort(words.begin(), words.end());
+  words.erase(std::unique(words.begin(), words.end()), words.end());
+  uint64_t hash = 0;
+  for (const std::string &word : words)
+  {
+    hash = util::MurmurHashNative(word.c_str(), word.size() + 1, hash);
+  }
+  return hash;
+}
+
+static double seconds_since(std::chrono::steady_clock::time_point start)
+{
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// reserve a unique name next to the entry, return it
+static std::string make_temp(const std::string &prefix)
+{
+  std::string temp = prefix + ".XXXXXX";
+  std::vector<char> temp_name(temp.begin(), temp.end());
+  temp_name.push_back('\0');
+  const int temp_fd = mkstemp(temp_name.data());
+  if (temp_fd < 0)
+  {
+    throw std::runtime_error("cannot create a temporary file " + temp);
+  }
+  fchmod(temp_fd, 0644);  // mkstemp makes it private, the cache may be shared
+  close(temp_fd);
+  return temp_name.data();
+}
+
+// n-gram counts per order of a restricted entry in <entry>.counts:
+// a line for the ARPA file, then one for the kept n-grams
+static void write_counts(const std::string &path, const std::vector<uint64_t> &counts,
+                         const std::vector<uint64_t> &kept_counts)
+{
+  FILE *file = fopen(path.c_str(), "w");
+  if (file == nullptr)
+  {
+    throw std::runtime_error("cannot write " + path);
+  }
+  for (const std::vector<uint64_t> *line : {&counts, &kept_counts})
+  {
+    for (size_t i = 0; i < line->size(); i++)
+    {
+      fprintf(file, i == 0 ? "%" PRIu64 : " %" PRIu64, (*line)[i]);
+    }
+    fprintf(file, "\n");
+  }
+  const bool written = fflush(file) == 0 && fsync(fileno(file)) == 0;
+  if (fclose(file) != 0 || !written)
+  {
+    throw std::runtime_error("cannot write " + path);
+  }
+}
+
+// false at the end of the file or if the line is not a list of counts
+static bool read_count_line(FILE *file, std::vector<uint64_t> &counts)
+{
+  char line[512];
+  if (fgets(line, sizeof(line), file) == nullptr)
+  {
+    return false;
+  }
+  counts.clear();
+  char *end = line;
+  for (;;)
+  {
+    char *begin = end;
+    const uint64_t count = strtoull(begin, &end, 10);
+    if (end == begin)
+    {
+      break;
+    }
+    counts.push_back(count);
+  }
+  return !counts.empty() && *end == '\n';
+}
+
+// false if the file is missing or incomplete
+static bool read_counts(const std::string &path, std::vector<uint64_t> &counts, std::vector<uint64_t> &kept_counts)
+{
+  FILE *file = fopen(path.c_str(), "r");
+  if (file == nullptr)
+  {
+    return false;
+  }
+  const bool read = read_count_line(file, counts) && read_count_line(file, kept_counts);
+  fclose(file);
+  return read;
+}
+
+// write the n-grams of arpa_path made of words (and tags) to filtered_path, as an ARPA file
+static void filter_arpa(const std::string &arpa_path, const std::vector<std::string> &words,
+                        const std::string &filtered_path)
+{
+  lm::vocab::Single::Words kept(words.begin(), words.end());
+  lm::vocab::Single single(kept);
+  lm::BinaryFilter<lm::vocab::Single> filter(single);
+  util::FilePiece in(arpa_path.c_str());
+  lm::ARPAOutput out(filtered_path.c_str());
+  lm::ARPAFormat::RunFilter(in, filter, out);
+}
+
+CachedBinary cached_binary(const std::string &arpa_path, const std::string &cache_dir, ModelType type,
+                           const std::vector<std::string> &restrict_vocab)
+{
+  const char *type_name = binary_type_name(type);
+  if (mkdir(cache_dir.c_str(), 0755) != 0 && errno != EEXIST)
+  {
+    throw std::runtime_error("cannot create the binary cache directory " + cache_dir);
+  }
+
+  CachedBinary binary;
+  binary.build_seconds = 0;
+  binary.ngrams = binary.kept_ngrams = binary.model_bytes = binary.kept_model_bytes = 0;
+  auto start = std::chrono::steady_clock::now();
+  char name[64];
+  if (restrict_vocab.empty())
+  {
+    snprintf(name, sizeof(name), "%016" PRIx64 ".%s.binary", hash_file(arpa_path), type_name);
+  }
+  else
+  {
+    snprintf(name, sizeof(name), "%016" PRIx64 ".%016" PRIx64 ".%s.binary", hash_file(arpa_path),
+             hash_words(restrict_vocab), type_name);
+  }
+  binary.path = cache_dir + "/" + name;
+  binary.hash_seconds = seconds_since(start);
+
+  // restricted entries keep the n-gram counts next to them, written before the binary is renamed
+  // into place: an entry without them (e.g. from an interrupted build) is built again
+  const std::string counts_path = binary.path + ".counts";
+  std::vector<uint64_t> counts, kept_counts;
+  ModelType cached_type;
+  binary.hit = access(binary.path.c_str(), R_OK) == 0 && RecognizeBinary(binary.path.c_str(), cached_type) &&
+               cached_type == type && (restrict_vocab.empty() || read_counts(counts_path, counts, kept_counts));
+  if (!binary.hit)
+  {
+    // KenLM truncates and fills the reserved files
+    const std::string temp = make_temp(binary.path);
+    const std::string filtered = restrict_vocab.empty() ? std::string() : make_temp(binary.path + ".arpa");
+    const std::string temp_counts = restrict_vocab.empty() ? std::string() : make_temp(counts_path);
+    start = std::chrono::steady_clock::now();
+    try
+    {
+      if (!filtered.empty())
+      {
+        filter_arpa(arpa_path, restrict_vocab, filtered);
+        // only the headers are read
+        util::FilePiece in(arpa_path.c_str());
+        lm::ReadARPACounts(in, counts);
+        util::FilePiece kept_in(filtered.c_str());
+        lm::ReadARPACounts(kept_in, kept_counts);
+        write_counts(temp_counts, counts, kept_counts);
+        if (rename(temp_counts.c_str(), counts_path.c_str()) != 0)
+        {
+          throw std::runtime_error("cannot move the n-gram counts to " + counts_path);
+        }
+      }
+      Config config;
+      config.write_mmap = temp.c_str();
+      delete LoadVirtual(filtered.empty() ? arpa_path.c_str() : filtered.c_str(), config, type);
+
+      util::scoped_fd written(util::OpenReadOrThrow(temp.c_str()));
+      util::FSyncOrThrow(written.get());
+      if (rename(temp.c_str(), binary.path.c_str()) != 0)
+      {
+        throw std::runtime_error("cannot move the compiled model to " + binary.path);
+      }
+    }
+    catch (...)
+    {
+      unlink(temp.c_str());
+      if (!filtered.empty())
+      {
+        unlink(filtered.c_str());
+        unlink(temp_counts.c_str());
+      }
+      throw;
+    }
+    if (!filtered.empty())
+    {
+      unlink(filtered.c_str());
+    }
+    binary.build_seconds = seconds_since(start);
+  }
+
+  if (!restrict_vocab.empty())
+  {
+    binary.ngrams = sum(counts);
+    binary.kept_ngrams = sum(kept_counts);
+    binary.model_bytes = model_bytes(type, counts);
+    binary.kept_model_bytes = model_bytes(type, kept_counts);
+  }
+  return binary;
+}
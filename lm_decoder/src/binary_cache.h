@@ -0,0 +1,49 @@
+#ifndef BINARY_CACHE_H_
+#define BINARY_CACHE_H_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "lm/binary_format.hh"
+
+/* ARPA models compiled once into KenLM binaries kept in a cache directory.
+ *
+ * Parsing an ARPA file (plain or compressed) takes minutes and a lot of peak
+ * memory on large models, in every process that loads it. Instead, the first
+ * load builds a binary of the requested type through KenLM's write_mmap and
+ * the later ones load that binary.
+ *
+ * Entries are named after a hash of the ARPA file's content and the binary
+ * type, so an edited model gets a new entry. A binary is written under a
+ * temporary name and renamed into place: concurrent builders never expose a
+ * partial file, and the last rename wins with an identical binary.
+ *
+ * Given a restricting vocabulary, only the n-grams made of its words (and of
+ * tags such as <s>, </s>, <unk>) are kept, through KenLM's lm/filter. Every
+ * n-gram and backoff that a query over those words can reach is kept
+ * unchanged, so such queries score exactly as with the full model (QUANT_TRIE
+ * fits its bins to the kept n-grams), while the tables shrink to what the
+ * decoder can actually look up. Such entries are also named after a hash of
+ * the vocabulary, and their n-gram counts are kept next to them in
+ * <entry>.counts. */
+struct CachedBinary
+{
+  std::string path;      // binary to load
+  bool hit;              // already in the cache
+  double hash_seconds;   // reading the ARPA file to find its entry
+  double build_seconds;  // compiling it on a miss
+
+  // with a restricting vocabulary: n-grams and size (bytes) of the model in memory, in full and restricted
+  uint64_t ngrams;
+  uint64_t kept_ngrams;
+  uint64_t model_bytes;
+  uint64_t kept_model_bytes;
+};
+
+// type: PROBING, TRIE or QUANT_TRIE (8 bit probabilities and backoffs), cache_dir is created if missing,
+// restrict_vocab: the words to keep n-grams of, empty to keep the whole model
+CachedBinary cached_binary(const std::string &arpa_path, const std::string &cache_dir, lm::ngram::ModelType type,
+                           const std::vector<std::string> &restrict_vocab = std::vector<std::string>());
+
+#endif  // BINARY_CACHE_H_
@@ -2,297 +2,389 @@
 #include <torch/torch.h>
 #include <string>
 #include <vector>
+#include <map>
+#include <memory>
 #include <set>
-#include <numeric>   // std::iota
-#include <algorithm> // std::sort
+#include <stdexcept>
 #include "lm/model.hh"
 #include "lm/config.hh"
 #include "util/tokenize_piece.hh"
 #include "util/string_piece.hh"
 #include "util/string_stream.hh"
+#include "beam_search.h"
+#include "ensemble.h"
+#include "incremental_scores.h"
 #include "kenlm_scorer.h"
-#include "ThreadPool.h"
+#include "tensor_view.h"
+#include "worker_pool.h"
 
 using namespace lm::ngram;
 
-template <typename T>
-std::vector<size_t> argtopk(const std::vector<T> &v, int k)
+// Wrap a CPU tensor of min_dim to max_dim dimensions without copying or converting it.
+TensorView view_of(const at::Tensor &tensor, const char *name, int min_dim, int max_dim)
 {
+  if (tensor.is_cuda()){
+    throw std::invalid_argument("lm_decoder expects CPU tensors");
+  }
+  if (tensor.dim() < min_dim || tensor.dim() > max_dim){
+    throw std::invalid_argument(std::string(name) + " has " + std::to_string(tensor.dim()) +
+                                " dimensions, expected " + std::to_string(min_dim) +
+                                (max_dim > min_dim ? " or " + std::to_string(max_dim) : std::string()));
+  }
+
+  TensorView view = TensorView();
+  view.data = tensor.data_ptr();
+  view.dim = tensor.dim();
+  for (int d = 0; d < view.dim; d++)
+  {
+    view.sizes[d] = tensor.size(d);
+    view.strides[d] = tensor.stride(d);
+  }
 
-  // initialize original index locations
-  std::vector<size_t> idx(v.size());
-  std::iota(idx.begin(), idx.end(), 0);
+  switch (tensor.scalar_type())
+  {
+  case at::kBool: view.dtype = DType::Bool; break;
+  case at::kByte: view.dtype = DType::UInt8; break;
+  case at::kInt: view.dtype = DType::Int32; break;
+  case at::kLong: view.dtype = DType::Int64; break;
+  case at::kHalf: view.dtype = DType::Float16; break;
+  case at::kBFloat16: view.dtype = DType::BFloat16; break;
+  case at::kFloat: view.dtype = DType::Float32; break;
+  case at::kDouble: view.dtype = DType::Float64; break;
+  default:
+    throw std::invalid_argument("lm_decoder does not support this tensor type");
+  }
+  return view;
+}
 
-  // sort indexes based on comparing values in v
-  // from large to small
-  std::nth_element(idx.begin(), idx.begin() + k, idx.end(),
-                   [&v](size_t i1, size_t i2) { return v[i1] > v[i2]; });
+TensorView view_of(const at::Tensor &tensor, const char *name, int dim)
+{
+  return view_of(tensor, name, dim, dim);
+}
 
-  return idx;
+// lengths (1-d) or masks (2-d)
+TensorView lens_view_of(const at::Tensor &lens)
+{
+  return view_of(lens, "masks", 1, 2);
 }
 
-template <typename T>
-std::vector<size_t> argsort(const std::vector<T> &v)
+/* Inputs are read in place whatever their dtype (int32/int64 indices,
+ * float16/bfloat16/float32/float64 probabilities) and strides; the n-best
+ * is written into out_seqs (which may be seqs itself) and out_scores. */
+void beam_search(void *scorer,
+                 void *pool,
+                 at::Tensor probs,
+                 at::Tensor seqs,
+                 at::Tensor gates,
+                 at::Tensor lens,
+                 at::Tensor out_seqs,
+                 at::Tensor out_scores,
+                 const int beam_width,
+                 const int type,
+                 const float prune_margin)
 {
+  Scorer *lm_scorer = static_cast<Scorer *>(scorer);
+  WorkerPool *worker_pool = static_cast<WorkerPool *>(pool);
 
-  // initialize original index locations
-  std::vector<size_t> idx(v.size());
-  std::iota(idx.begin(), idx.end(), 0);
+  beam_search_batch(lm_scorer, worker_pool,
+                    view_of(probs, "probs", 3), view_of(seqs, "seqs", 3), view_of(gates, "gates", 2),
+                    lens_view_of(lens), view_of(out_seqs, "out_seqs", 3), view_of(out_scores, "out_scores", 2),
+                    beam_width, type, prune_margin);
+}
 
-  // sort indexes based on comparing values in v
-  // from large to small
-  std::sort(idx.begin(), idx.end(),
-            [&v](size_t i1, size_t i2) { return v[i1] > v[i2]; });
+// Outstanding beam_search_async call, keeps its tensors alive until the search is done.
+class BeamSearchHandle
+{
+public:
+  BeamSearchHandle(const std::vector<at::Tensor> &tensors, std::shared_ptr<WorkerPool::Job> job)
+      : tensors_(tensors), job_(job) {}
 
-  return idx;
+  ~BeamSearchHandle()
+  {
+    // the workers write into tensors_, never free them under a running search
+    try
+    {
+      job_->wait();
+    }
+    catch (...)
+    {
+    }
+  }
+
+  bool done() { return job_->done(); }
+
+  // block until the search is finished, raising its error if any
+  void wait() { job_->wait(); }
+
+private:
+  std::vector<at::Tensor> tensors_;
+  std::shared_ptr<WorkerPool::Job> job_;
+};
+
+std::shared_ptr<BeamSearchHandle>
+beam_search_async(void *scorer,
+                  void *pool,
+                  at::Tensor probs,
+                  at::Tensor seqs,
+                  at::Tensor gates,
+                  at::Tensor lens,
+                  at::Tensor out_seqs,
+                  at::Tensor out_scores,
+                  const int beam_width,
+                  const int type,
+                  const float prune_margin)
+{
+  Scorer *lm_scorer = static_cast<Scorer *>(scorer);
+  WorkerPool *worker_pool = static_cast<WorkerPool *>(pool);
+
+  std::shared_ptr<WorkerPool::Job> job = submit_beam_search(
+      lm_scorer, worker_pool,
+      view_of(probs, "probs", 3), view_of(seqs, "seqs", 3), view_of(gates, "gates", 2), lens_view_of(lens),
+      view_of(out_seqs, "out_seqs", 3), view_of(out_scores, "out_scores", 2), beam_width, type, prune_margin);
+  return std::make_shared<BeamSearchHandle>(
+      std::vector<at::Tensor>{probs, seqs, gates, lens, out_seqs, out_scores}, job);
 }
 
-float log_sum_exp(std::vector<float> &v, int begin, int end)
+void beam_search_ensemble(void *ensemble,
+                          void *pool,
+                          at::Tensor probs,
+                          at::Tensor seqs,
+                          at::Tensor gates,
+                          at::Tensor lens,
+                          at::Tensor out_seqs,
+                          at::Tensor out_scores,
+                          const int beam_width,
+                          const int type)
 {
-  float init = 0;
-  float max_elem = *std::max_element(v.begin() + begin, v.begin() + end);
-  float sum = std::accumulate(v.begin() + begin, v.begin() + end, init, 
-     [max_elem](float a, float b) { return a + std::exp(b - max_elem); });
-  return max_elem + std::log(sum);
+  Ensemble *lm_ensemble = static_cast<Ensemble *>(ensemble);
+  WorkerPool *worker_pool = static_cast<WorkerPool *>(pool);
+
+  beam_search_ensemble_batch(lm_ensemble, worker_pool,
+                             view_of(probs, "probs", 3), view_of(seqs, "seqs", 3), view_of(gates, "gates", 2),
+                             lens_view_of(lens), view_of(out_seqs, "out_seqs", 3),
+                             view_of(out_scores, "out_scores", 2), beam_width, type);
 }
 
+std::shared_ptr<BeamSearchHandle>
+beam_search_ensemble_async(void *ensemble,
+                           void *pool,
+                           at::Tensor probs,
+                           at::Tensor seqs,
+                           at::Tensor gates,
+                           at::Tensor lens,
+                           at::Tensor out_seqs,
+                           at::Tensor out_scores,
+                           const int beam_width,
+                           const int type)
+{
+  Ensemble *lm_ensemble = static_cast<Ensemble *>(ensemble);
+  WorkerPool *worker_pool = static_cast<WorkerPool *>(pool);
+
+  std::shared_ptr<WorkerPool::Job> job = submit_beam_search_ensemble(
+      lm_ensemble, worker_pool,
+      view_of(probs, "probs", 3), view_of(seqs, "seqs", 3), view_of(gates, "gates", 2), lens_view_of(lens),
+      view_of(out_seqs, "out_seqs", 3), view_of(out_scores, "out_scores", 2), beam_width, type);
+  return std::make_shared<BeamSearchHandle>(
+      std::vector<at::Tensor>{probs, seqs, gates, lens, out_seqs, out_scores}, job);
+}
 
-float weighted_logsumexp(float x, float y, float g)
+void get_kenlm_scores(void *scorer,
+                      void *pool,
+                      at::Tensor seqs,
+                      at::Tensor lens,
+                      at::Tensor outs)
 {
-  if (x > y){
-    return x + std::log(g + (1 - g) * std::exp(y - x));
-  }
-  else{
-    return y + std::log((1 - g) + g * std::exp(x - y));
+  Scorer *lm_scorer = static_cast<Scorer *>(scorer);
+  WorkerPool *worker_pool = static_cast<WorkerPool *>(pool);
+
+  kenlm_scores_batch(lm_scorer, worker_pool, view_of(seqs, "seqs", 2), lens_view_of(lens),
+                     view_of(outs, "outs", 2));
+}
+
+void get_kenlm_scores_ensemble(void *ensemble,
+                               void *pool,
+                               at::Tensor seqs,
+                               at::Tensor lens,
+                               at::Tensor outs)
+{
+  Ensemble *lm_ensemble = static_cast<Ensemble *>(ensemble);
+  WorkerPool *worker_pool = static_cast<WorkerPool *>(pool);
+
+  kenlm_scores_ensemble_batch(lm_ensemble, worker_pool, view_of(seqs, "seqs", 2), lens_view_of(lens),
+                              view_of(outs, "outs", 2));
+}
+
+// interpolation: 0 linear, 1 log-linear; the scorers must outlive the ensemble
+void *get_ensemble(const std::vector<void *> scorers, const std::vector<float> weights, const int interpolation)
+{
+  std::vector<Scorer *> models;
+  for (void *scorer : scorers)
+  {
+    models.push_back(static_cast<Scorer *>(scorer));
   }
+  Ensemble *ensemble = new Ensemble(models, weights, interpolation);
+  return static_cast<void *>(ensemble);
 }
 
-std::vector<float>
- _beam_search_(Scorer *lm_scorer,
-               at::Tensor &probs,
-               at::Tensor &seqs,
-               at::Tensor &gates,
-               at::Tensor &lens,
-               const int beam_width,
-               int index,
-               const int type)
+void free_ensemble(void *ensemble)
 {
-  // type = 0: mixture of experts: log( \alpha * p_TM + (1 - \alpha) * p_LM )
-  // type = 1: shallow fusion: \alpha * log p_TM + (1 - \alpha) * log p_LM (as scores)
-  // type = 2: simple fusion: log( softmax(\alpha * TM_scores + (1 - \alpha) * log p_LM (as scores)))
+  delete static_cast<Ensemble *>(ensemble);
+}
 
-  auto probs_acc = probs.accessor<float, 3>();
-  auto seqs_acc = seqs.accessor<int, 3>();
-  auto lens_acc = lens.accessor<int, 1>();
-  auto gates_acc = gates.accessor<float, 2>();
+void *get_incremental_scores(void *scorer)
+{
+  IncrementalScores *scores = new IncrementalScores(static_cast<Scorer *>(scorer));
+  return static_cast<void *>(scores);
+}
 
-  const int32_t num_candidates = probs.size(2);
-  const int32_t length = (int)lens_acc[index];
+void free_incremental_scores(void *scores)
+{
+  delete static_cast<IncrementalScores *>(scores);
+}
 
-  // for simplification
-  assert (~(beam_width > num_candidates));  // beam size cannot be bigger than candidates.
+// like get_kenlm_scores, only rescoring what changed since the previous call on the same handle
+void incremental_scores(void *scores,
+                        void *pool,
+                        at::Tensor seqs,
+                        at::Tensor lens,
+                        at::Tensor outs)
+{
+  IncrementalScores *incremental = static_cast<IncrementalScores *>(scores);
+  WorkerPool *worker_pool = static_cast<WorkerPool *>(pool);
 
-  std::vector<std::vector<int>> prefixes(beam_width);
-  std::vector<std::vector<int>> temp_prefixes(beam_width);
-  std::vector<float> cum_scores(beam_width, 0);
-  std::vector<float> temp_scores(beam_width * num_candidates);
-  std::vector<size_t> idx(beam_width);
+  incremental->score(worker_pool, view_of(seqs, "seqs", 2), lens_view_of(lens), view_of(outs, "outs", 2));
+}
 
-  // KenLM states
-  std::vector<State> states(beam_width);
-  std::vector<State> tmp_states(beam_width);
-  std::vector<State> out_states(beam_width * num_candidates);
+void reset_incremental_scores(void *scores)
+{
+  static_cast<IncrementalScores *>(scores)->reset();
+}
 
-  // start the language model.
-  lm_scorer->start(states[0]);
+std::map<std::string, double> get_incremental_stats(void *scores)
+{
+  return static_cast<IncrementalScores *>(scores)->get_stats();
+}
 
-  for (size_t t = 0; t < length; t++)
-  {
-    int max_width = (t > 0) ? beam_width : 1;
-    for (size_t b = 0; b < max_width; b++)
-    {
-      for (size_t c = 0; c < num_candidates; c++)
-      {
-        if (type == 0){
-          temp_scores[b * num_candidates + c] = cum_scores[b] + 
-            weighted_logsumexp(
-              std::log(probs_acc[index][t][c]), 
-              lm_scorer->get_base_log_prob(
-                states[b], 
-                lm_scorer->get_word(seqs_acc[index][t][c]), 
-                out_states[b * num_candidates + c]),
-              gates_acc[index][t]);
-        }
-        else if (type == 1){
-          temp_scores[b * num_candidates + c] = cum_scores[b] + 
-            gates_acc[index][t] * std::log(probs_acc[index][t][c]) +
-            (1 - gates_acc[index][t]) * lm_scorer->get_base_log_prob(
-              states[b], lm_scorer->get_word(seqs_acc[index][t][c]), out_states[b * num_candidates + c]);
-
-        }
-        else if (type == 2){
-          temp_scores[b * num_candidates + c] = 
-            gates_acc[index][t] * std::log(probs_acc[index][t][c]) +
-            (1 - gates_acc[index][t]) * lm_scorer->get_base_log_prob(
-              states[b], lm_scorer->get_word(seqs_acc[index][t][c]), out_states[b * num_candidates + c]);
-        }
-      }
-
-      if (type == 2){
-        float Z = log_sum_exp(temp_scores, b * num_candidates, (b + 1) * num_candidates);
-        for (size_t c = 0; c < num_candidates; c++)
-        {
-          temp_scores[b * num_candidates + c] = cum_scores[b] + temp_scores[b * num_candidates + c] - Z;
-        }
-      }
-    }
-     
-    // top-k selection
-    if (t > 0){
-      idx = argtopk(temp_scores, beam_width);
-    } else{
-      std::iota(idx.begin(), idx.end(), 0);
-    }
-    
-    // re-ordering
-    for (size_t b = 0; b < beam_width; b++)
-    {
-      if (t > 0)
-      {
-        temp_prefixes[b] = prefixes[idx[b] / num_candidates];
-      }
-      temp_prefixes[b].push_back(seqs_acc[index][t][idx[b] % num_candidates]);
-      cum_scores[b] = temp_scores[idx[b]];
-
-      // make sure pointers are not mixed
-      tmp_states[b] = states[b];
-      states[b] = out_states[idx[b]];
-      out_states[idx[b]] = tmp_states[b];
-    }
+void *get_beam_session(void *scorer, const int beam_width, const int type, const float prune_margin)
+{
+  BeamSession *session = new BeamSession(static_cast<Scorer *>(scorer), beam_width, type, prune_margin);
+  return static_cast<void *>(session);
+}
 
-    for (size_t b = 0; b < beam_width; b++)
-    {
-      prefixes[b] = temp_prefixes[b];
-    }
-  }
-  // final sort rank again with the final score  
-  for (size_t b = 0; b < beam_width; b++){
-    temp_scores[b] = cum_scores[b] + lm_scorer->get_base_log_prob(states[b], END_TOKEN, out_states[b]);
-  }
+void free_beam_session(void *session)
+{
+  delete static_cast<BeamSession *>(session);
+}
 
-  idx = argsort(std::vector<float>(temp_scores.begin(), temp_scores.begin() + beam_width));
-  
-  // write the searched results back to seqs (overrides)
-  for (size_t b = 0; b < beam_width; b++){
-    for (size_t t = 0; t < length; t++)
-    {
-      seqs_acc[index][t][b] = prefixes[idx[b]][t];
-    }
-    cum_scores[b] = temp_scores[idx[b]];
-  }
-  
-  return cum_scores;
-}
-
-std::vector<std::vector<float>> 
-beam_search(void *scorer,
-            at::Tensor probs,
-            at::Tensor seqs,
-            at::Tensor gates,
-            at::Tensor lens,
-            const int beam_width,
-            const int workers,
-            const int type)
-{
-  Scorer *lm_scorer = NULL;
-  if (scorer != NULL){
-    lm_scorer = static_cast<Scorer *>(scorer);
-  }
+void beam_session_init(void *session, const int64_t batch_size)
+{
+  static_cast<BeamSession *>(session)->init(batch_size);
+}
 
-  const int32_t batch_size = probs.size(0);
-  std::vector<std::vector<float>> all_scores;
+// probs, seqs: batch x steps x short_list, gates: batch x steps, lens: the steps of each sentence in this chunk
+void beam_session_step(void *session,
+                       void *pool,
+                       at::Tensor probs,
+                       at::Tensor seqs,
+                       at::Tensor gates,
+                       at::Tensor lens)
+{
+  BeamSession *beam_session = static_cast<BeamSession *>(session);
+  WorkerPool *worker_pool = static_cast<WorkerPool *>(pool);
 
-  if (batch_size == 1)
-  {
-    // single sentence testing.. no need to do multi-threads
-    all_scores.push_back(_beam_search_(lm_scorer, probs, seqs, gates, lens, beam_width, 0, type));
-    return all_scores;
-  }
+  beam_session->step(worker_pool, view_of(probs, "probs", 3), view_of(seqs, "seqs", 3), view_of(gates, "gates", 2),
+                     lens_view_of(lens));
+}
 
-  ThreadPool pool(workers);
-  std::vector<std::future<std::vector<float>>> res;
-  for (size_t i = 0; i < batch_size; i++)
-  {
-    res.emplace_back(pool.enqueue(
-        _beam_search_, lm_scorer, probs, seqs, gates, lens, beam_width, i, type));
-  }
+void beam_session_finalize(void *session,
+                           void *pool,
+                           at::Tensor out_seqs,
+                           at::Tensor out_scores)
+{
+  BeamSession *beam_session = static_cast<BeamSession *>(session);
+  WorkerPool *worker_pool = static_cast<WorkerPool *>(pool);
 
-  // get decoding results
-  for (size_t i = 0; i < batch_size; ++i)
-  {
-    all_scores.emplace_back(res[i].get());
-  }
+  beam_session->finalize(worker_pool, view_of(out_seqs, "out_seqs", 3), view_of(out_scores, "out_scores", 2));
+}
 
-  return all_scores;
+int beam_session_max_length(void *session)
+{
+  return static_cast<BeamSession *>(session)->get_max_length();
 }
 
-int _get_kenlm_scores_(Scorer *lm_scorer,
-                        at::Tensor &seqs,
-                        at::Tensor &lens,
-                        at::Tensor &outs,
-                        int index)
+// load_method: util::LoadMethod (0 lazy, 1 populate_or_lazy, 2 populate_or_read, 3 read, 4 parallel_read)
+// binary_type: lm::ngram::ModelType of the binaries ARPA files are compiled to (0 probing, 2 trie, 3 quant_trie),
+// binary_cache_dir: where they are kept, empty to parse ARPA files on every load,
+// restrict_vocab: keep only the n-grams of vocab in those binaries
+void *get_kenlm_scorer(const char *lm_path, const std::vector<std::string> vocab, const int load_method,
+                       const std::string binary_cache_dir, const int binary_type, const bool restrict_vocab)
 {
-  auto outs_acc = outs.accessor<float, 2>();
-  auto seqs_acc = seqs.accessor<int, 2>();
-  auto lens_acc = lens.accessor<int, 1>();
-  const int32_t length = (int)lens_acc[index];
+  Scorer *scorer = new Scorer(lm_path, vocab, static_cast<util::LoadMethod>(load_method), binary_cache_dir,
+                              static_cast<ModelType>(binary_type), restrict_vocab);
+  return static_cast<void *>(scorer);
+}
 
-  std::vector<std::string> words;
-  std::vector<float> lm_scores;
+void *get_worker_pool(const int workers, const bool pin_cpus)
+{
+  WorkerPool *pool = new WorkerPool(workers, pin_cpus);
+  return static_cast<void *>(pool);
+}
 
-  for (size_t t = 0; t < length; t++)
-  {
-    words.push_back(lm_scorer->get_word(seqs_acc[index][t]));
-  }
-  lm_scores = lm_scorer->get_sent_log_prob(words);
-  for (size_t t = 0; t < lm_scores.size(); t++)
-  {
-    outs_acc[index][t] = lm_scores[t];
-  }
+void free_worker_pool(void *pool)
+{
+  delete static_cast<WorkerPool *>(pool);
+}
 
-  return 1;
+std::vector<double> get_busy_time(void *pool)
+{
+  return static_cast<WorkerPool *>(pool)->busy_time();
 }
 
-void get_kenlm_scores(void *scorer,
-                      at::Tensor seqs,
-                      at::Tensor lens,
-                      at::Tensor outs,
-                      const int workers)
+void reset_busy_time(void *pool)
 {
-  Scorer *lm_scorer = NULL;
-  if (scorer != NULL){
-    lm_scorer = static_cast<Scorer *>(scorer);
-  }
+  static_cast<WorkerPool *>(pool)->reset_busy_time();
+}
 
-  const int32_t batch_size = seqs.size(0);
-  ThreadPool pool(workers);
+void set_cache(void *scorer, const size_t workers, const size_t entries)
+{
+  Scorer *ext_scorer = static_cast<Scorer *>(scorer);
+  ext_scorer->set_cache(workers, entries);
+}
 
-  std::vector<std::future<int>> res;
-  for (size_t i = 0; i < batch_size; i++)
-  {
-    res.emplace_back(pool.enqueue(
-        _get_kenlm_scores_, lm_scorer, seqs, lens, outs, i));
-  }
-  for (size_t i = 0; i < batch_size; ++i)
-  {
-    res[i].get();
-  }
+std::map<std::string, double> get_cache_stats(void *scorer)
+{
+  Scorer *ext_scorer = static_cast<Scorer *>(scorer);
+  return ext_scorer->get_cache_stats();
 }
 
-void *get_kenlm_scorer(const char *lm_path, const std::vector<std::string> vocab)
+void reset_cache_stats(void *scorer)
 {
-  Scorer *scorer = new Scorer(lm_path, vocab);
-  return static_cast<void *>(scorer);
+  Scorer *ext_scorer = static_cast<Scorer *>(scorer);
+  ext_scorer->reset_cache_stats();
+}
+
+void set_stats(void *scorer, const size_t workers, const bool enabled)
+{
+  Scorer *ext_scorer = static_cast<Scorer *>(scorer);
+  ext_scorer->set_stats(workers, enabled);
+}
+
+std::map<std::string, double> get_decoder_stats(void *scorer)
+{
+  Scorer *ext_scorer = static_cast<Scorer *>(scorer);
+  return ext_scorer->get_decoder_stats();
+}
+
+void reset_decoder_stats(void *scorer)
+{
+  Scorer *ext_scorer = static_cast<Scorer *>(scorer);
+  ext_scorer->reset_decoder_stats();
+}
+
+std::map<std::string, double> get_load_stats(void *scorer)
+{
+  Scorer *ext_scorer = static_cast<Scorer *>(scorer);
+  return ext_scorer->get_load_stats();
 }
 
 size_t get_max_order(void *scorer)
@@ -310,9 +402,50 @@ size_t get_dict_size(void *scorer)
 
 PYBIND11_MODULE(TORCH_EXTENSION_NAME, m)
 {
-  m.def("beam_search", &beam_search, "beam_search");
+  // decoding never touches python objects, let other python threads run meanwhile
+  m.def("beam_search", &beam_search, "beam_search",
+        py::call_guard<py::gil_scoped_release>());
+  m.def("beam_search_async", &beam_search_async, "beam_search_async",
+        py::call_guard<py::gil_scoped_release>());
+  py::class_<BeamSearchHandle, std::shared_ptr<BeamSearchHandle>>(m, "BeamSearchHandle")
+      .def("done", &BeamSearchHandle::done)
+      .def("wait", &BeamSearchHandle::wait, py::call_guard<py::gil_scoped_release>());
+  m.def("beam_search_ensemble", &beam_search_ensemble, "beam_search_ensemble",
+        py::call_guard<py::gil_scoped_release>());
+  m.def("beam_search_ensemble_async", &beam_search_ensemble_async, "beam_search_ensemble_async",
+        py::call_guard<py::gil_scoped_release>());
   m.def("get_kenlm_scorer", &get_kenlm_scorer, "get_kenlm_scorer");
-  m.def("get_kenlm_scores", &get_kenlm_scores, "get_kenlm_scores");
+  m.def("get_kenlm_scores", &get_kenlm_scores, "get_kenlm_scores",
+        py::call_guard<py::gil_scoped_release>());
+  m.def("get_kenlm_scores_ensemble", &get_kenlm_scores_ensemble, "get_kenlm_scores_ensemble",
+        py::call_guard<py::gil_scoped_release>());
+  m.def("get_ensemble", &get_ensemble, "get_ensemble");
+  m.def("free_ensemble", &free_ensemble, "free_ensemble");
+  m.def("get_incremental_scores", &get_incremental_scores, "get_incremental_scores");
+  m.def("free_incremental_scores", &free_incremental_scores, "free_incremental_scores");
+  m.def("incremental_scores", &incremental_scores, "incremental_scores",
+        py::call_guard<py::gil_scoped_release>());
+  m.def("reset_incremental_scores", &reset_incremental_scores, "reset_incremental_scores");
+  m.def("get_incremental_stats", &get_incremental_stats, "get_incremental_stats");
+  m.def("get_beam_session", &get_beam_session, "get_beam_session");
+  m.def("free_beam_session", &free_beam_session, "free_beam_session");
+  m.def("beam_session_init", &beam_session_init, "beam_session_init");
+  m.def("beam_session_step", &beam_session_step, "beam_session_step",
+        py::call_guard<py::gil_scoped_release>());
+  m.def("beam_session_finalize", &beam_session_finalize, "beam_session_finalize",
+        py::call_guard<py::gil_scoped_release>());
+  m.def("beam_session_max_length", &beam_session_max_length, "beam_session_max_length");
+  m.def("get_worker_pool", &get_worker_pool, "get_worker_pool");
+  m.def("free_worker_pool", &free_worker_pool, "free_worker_pool");
+  m.def("get_busy_time", &get_busy_time, "get_busy_time");
+  m.def("reset_busy_time", &reset_busy_time, "reset_busy_time");
+  m.def("set_cache", &set_cache, "set_cache");
+  m.def("get_cache_stats", &get_cache_stats, "get_cache_stats");
+  m.def("reset_cache_stats", &reset_cache_stats, "reset_cache_stats");
+  m.def("set_stats", &set_stats, "set_stats");
+  m.def("get_decoder_stats", &get_decoder_stats, "get_decoder_stats");
+  m.def("reset_decoder_stats", &reset_decoder_stats, "reset_decoder_stats");
+  m.def("get_load_stats", &get_load_stats, "get_load_stats");
   m.def("get_max_order", &get_max_order, "get_max_order");
   m.def("get_dict_size", &get_dict_size, "get_dict_size");
 }
\ No newline at end of file
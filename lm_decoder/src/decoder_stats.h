@@ -0,0 +1,93 @@
+#ifndef DECODER_STATS_H_
+#define DECODER_STATS_H_
+
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+
+// per-sentence latencies are counted in power of two buckets: [0, 2) us, [2, 4) us, ..., [2^23 us, inf)
+const int LATENCY_BUCKETS = 24;
+
+inline uint64_t stats_clock()
+{
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/* Counters and timers of one worker.
+ * Only that worker writes them, so they are plain integers; they are read
+ * and reset while no batch is running. Decoding code takes a DecoderStats*
+ * that is null when statistics are off, which leaves one branch per stage. */
+struct DecoderStats
+{
+  DecoderStats() { reset(); }
+
+  void reset()
+  {
+    lm_lookups = lm_queries = oov = lm_pruned = 0;
+    sentences = tokens = 0;
+    read_ns = lm_ns = fuse_ns = topk_ns = reorder_ns = finish_ns = 0;
+    score_ns = decode_ns = queue_ns = 0;
+    std::memset(latency, 0, sizeof(latency));
+  }
+
+  void add_sentence(uint64_t length, uint64_t elapsed_ns)
+  {
+    sentences++;
+    tokens += length;
+    decode_ns += elapsed_ns;
+    int bucket = 0;
+    for (uint64_t us = elapsed_ns / 2000; us > 0 && bucket < LATENCY_BUCKETS - 1; us >>= 1)
+    {
+      bucket++;
+    }
+    latency[bucket]++;
+  }
+
+  uint64_t lm_lookups;  // LM scores asked for, cached or not
+  uint64_t lm_queries;  // of which went to KenLM
+  uint64_t oov;         // of which were for words unknown to the LM
+  uint64_t lm_pruned;   // candidates the pruned search did not need to look up
+
+  uint64_t sentences;
+  uint64_t tokens;
+
+  // stages of _beam_search_
+  uint64_t read_ns;     // TM probabilities and candidates of the step
+  uint64_t lm_ns;       // LM scores of the candidates
+  uint64_t fuse_ns;     // fusion of the TM and LM scores
+  uint64_t topk_ns;     // top-k selection
+  uint64_t reorder_ns;  // backpointers and KenLM states of the new beams
+  uint64_t finish_ns;   // </s>, final ranking and trace back
+
+  uint64_t score_ns;   // _get_kenlm_scores_
+  uint64_t decode_ns;  // whole sentences
+  uint64_t queue_ns;   // from submitting the batch to a worker claiming each chunk of it
+
+  uint64_t latency[LATENCY_BUCKETS];
+
+  char padding[64];  // keep the counters of two workers off the same cache line
+};
+
+// Adds the time since the previous lap to one of the stage timers, does nothing without stats.
+class StageTimer
+{
+public:
+  explicit StageTimer(DecoderStats *stats) : stats_(stats), last_(stats ? stats_clock() : 0) {}
+
+  void lap(uint64_t DecoderStats::*stage)
+  {
+    if (stats_ != nullptr)
+    {
+      const uint64_t now = stats_clock();
+      stats_->*stage += now - last_;
+      last_ = now;
+    }
+  }
+
+private:
+  DecoderStats *stats_;
+  uint64_t last_;
+};
+
+#endif  // DECODER_STATS_H_
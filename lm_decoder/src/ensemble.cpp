@@ -0,0 +1,46 @@
+#include "ensemble.h"
+
+#include <stdexcept>
+
+Ensemble::Ensemble(const std::vector<Scorer *> &scorers, const std::vector<float> &weights, int interpolation)
+    : scorers_(scorers), weights_(weights), interpolation_(interpolation)
+{
+  if (scorers_.empty() || weights_.size() != scorers_.size())
+  {
+    throw std::invalid_argument("an ensemble needs one weight per model");
+  }
+  if (interpolation_ != LINEAR && interpolation_ != LOG_LINEAR)
+  {
+    throw std::invalid_argument("interpolation must be linear (0) or log-linear (1)");
+  }
+  float sum = 0;
+  for (size_t m = 0; m < scorers_.size(); m++)
+  {
+    if (!(weights_[m] >= 0))
+    {
+      throw std::invalid_argument("ensemble weights must not be negative");
+    }
+    // the same MT word must be scored by every model, not only the same number of words
+    if (scorers_[m]->get_vocabulary() != scorers_[0]->get_vocabulary())
+    {
+      throw std::invalid_argument("the models of an ensemble must share the MT vocabulary");
+    }
+    sum += weights_[m];
+  }
+  if (interpolation_ == LINEAR)
+  {
+    // a mixture of probabilities: normalized so that it stays one
+    if (!(sum > 0))
+    {
+      throw std::invalid_argument("linear ensemble weights must not all be zero");
+    }
+    for (float &weight : weights_)
+    {
+      weight /= sum;
+    }
+  }
+  for (float weight : weights_)
+  {
+    log_weights_.push_back(std::log(weight));
+  }
+}
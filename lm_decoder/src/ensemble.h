@@ -0,0 +1,65 @@
+#ifndef ENSEMBLE_H_
+#define ENSEMBLE_H_
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "kenlm_scorer.h"
+
+/* Several KenLM models scored as one, e.g. a general-domain and an in-domain LM.
+ *
+ * Each model keeps its own KenLM states, word indices, caches and statistics,
+ * only their log probs (nats) of the same word are combined:
+ *   LINEAR:      log( \sum_m w_m * p_m )   (the weights are normalized to sum to 1)
+ *   LOG_LINEAR:  \sum_m w_m * log p_m   (not renormalized)
+ * The scorers must be built on the same MT vocabulary and outlive the ensemble. */
+class Ensemble {
+
+public:
+  enum Interpolation { LINEAR = 0, LOG_LINEAR = 1 };
+
+  Ensemble(const std::vector<Scorer *> &scorers, const std::vector<float> &weights, int interpolation);
+
+  size_t size() const { return scorers_.size(); }
+  Scorer *get_scorer(size_t model) const { return scorers_[model]; }
+  int get_interpolation() const { return interpolation_; }
+
+  // combine the log probs of one word, log_probs[m * stride] being the one of the m-th model
+  float combine(const float *log_probs, size_t stride) const
+  {
+    if (interpolation_ == LOG_LINEAR)
+    {
+      float score = 0;
+      for (size_t m = 0; m < scorers_.size(); m++)
+      {
+        score += weights_[m] * log_probs[m * stride];
+      }
+      return score;
+    }
+
+    float max_score = -INFINITY;
+    for (size_t m = 0; m < scorers_.size(); m++)
+    {
+      max_score = std::max(max_score, log_weights_[m] + log_probs[m * stride]);
+    }
+    if (max_score == -INFINITY)
+    {
+      return max_score;
+    }
+    float sum = 0;
+    for (size_t m = 0; m < scorers_.size(); m++)
+    {
+      sum += std::exp(log_weights_[m] + log_probs[m * stride] - max_score);
+    }
+    return max_score + std::log(sum);
+  }
+
+private:
+  std::vector<Scorer *> scorers_;
+  std::vector<float> weights_;
+  std::vector<float> log_weights_;
+  int interpolation_;
+};
+
+#endif  // ENSEMBLE_H_
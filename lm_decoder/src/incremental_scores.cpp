@@ -0,0 +1,123 @@
+#include "incremental_scores.h"
+
+#include <algorithm>
+
+#include "beam_search.h"  // get_length, check_score_inputs
+
+using namespace lm::ngram;
+
+template <class Model>
+void _rescore_row_(Scorer *lm_scorer,
+                   IncrementalScores::Row &row,
+                   const TensorView &seqs,
+                   const TensorView &lens,
+                   const TensorView &outs,
+                   int64_t index,
+                   ScoreCache *cache,
+                   DecoderStats *stats)
+{
+  const int32_t length = get_length(lens, index);
+  const int32_t old_length = row.length;
+  row.rescored = 0;
+
+  static thread_local std::vector<int> words;
+  words.resize(length);
+  seqs.read_ints(seqs.offset(index, 0), seqs.strides[1], length, words.data());
+
+  // [first, last]: the tokens that differ from the previous pass (new positions count as changed)
+  int32_t first = length, last = -1;
+  for (int32_t t = 0; t < length; t++)
+  {
+    if (t >= old_length || words[t] != row.tokens[t])
+    {
+      first = std::min(first, t);
+      last = t;
+    }
+  }
+  if (old_length < 0)
+  {
+    row.states.resize(1);
+    lm_scorer->start(row.states[0]);
+  }
+  row.tokens.resize(length);
+  row.states.resize(length + 1);
+  row.scores.resize(length + 1);
+
+  bool converged = (first == length);
+  State out_state;
+  for (int32_t t = first; t < length; t++)
+  {
+    row.tokens[t] = words[t];
+    row.scores[t] = lm_scorer->get_index_log_prob<Model>(row.states[t], words[t], out_state, cache, stats);
+    row.rescored++;
+    if (t > last && out_state == row.states[t + 1])
+    {
+      // the rest of the sentence is unchanged and starts from the same context
+      converged = true;
+      break;
+    }
+    row.states[t + 1] = out_state;
+  }
+  if (!converged || length != old_length)
+  {
+    row.scores[length] = lm_scorer->get_end_log_prob<Model>(row.states[length], out_state, cache, stats);
+    row.rescored++;
+  }
+  row.length = length;
+
+  for (int32_t t = 0; t <= length; t++)
+  {
+    outs.set_float(outs.offset(index, t), row.scores[t]);
+  }
+}
+
+typedef void (*rescore_row_fn)(Scorer *, IncrementalScores::Row &, const TensorView &, const TensorView &,
+                               const TensorView &, int64_t, ScoreCache *, DecoderStats *);
+
+struct RescoreRowDispatch
+{
+  template <class Model>
+  static rescore_row_fn apply() { return &_rescore_row_<Model>; }
+};
+
+void IncrementalScores::score(WorkerPool *pool, const TensorView &seqs, const TensorView &lens,
+                              const TensorView &outs)
+{
+  check_score_inputs(seqs, lens, outs);
+  const int64_t batch_size = seqs.size(0);
+  if (static_cast<int64_t>(rows_.size()) != batch_size)
+  {
+    rows_.assign(batch_size, Row());
+  }
+  rescore_row_fn rescore = dispatch_model<RescoreRowDispatch>(scorer_);
+
+  Scorer *lm_scorer = scorer_;
+  pool->parallel_for(batch_size, 0, [&](size_t worker, size_t begin, size_t end) {
+    for (size_t i = begin; i < end; i++)
+    {
+      rescore(lm_scorer, rows_[i], seqs, lens, outs, i, lm_scorer->get_cache(worker),
+              lm_scorer->get_stats(worker));
+    }
+  });
+
+  for (const Row &row : rows_)
+  {
+    positions_ += row.length + 1;
+    rescored_ += row.rescored;
+  }
+}
+
+std::map<std::string, double> IncrementalScores::get_stats() const
+{
+  std::map<std::string, double> stats;
+  stats["positions"] = positions_;
+  stats["rescored"] = rescored_;
+  stats["saved"] = positions_ > 0 ? 1 - double(rescored_) / positions_ : 0;
+  return stats;
+}
+
+void IncrementalScores::reset_stats()
+{
+  positions_ = 0;
+  rescored_ = 0;
+}
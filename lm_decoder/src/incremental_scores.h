@@ -0,0 +1,57 @@
+#ifndef INCREMENTAL_SCORES_H_
+#define INCREMENTAL_SCORES_H_
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "kenlm_scorer.h"
+#include "tensor_view.h"
+#include "worker_pool.h"
+
+/* Per-token LM scores of a batch that is refined over several passes
+ * (mask-predict style decoding), where each pass only changes a few tokens.
+ *
+ * The tokens, KenLM states and scores of every row are kept between calls.
+ * A row is only rescored from its first changed token, and rescoring stops
+ * as soon as the state after an unchanged token equals the stored one:
+ * KenLM states only hold the last n - 1 words, so everything after that
+ * point scores the same as before.
+ *
+ * A call with a different batch size starts over. One session must not be
+ * used by two calls at once. */
+class IncrementalScores {
+
+public:
+  explicit IncrementalScores(Scorer *scorer) : scorer_(scorer), positions_(0), rescored_(0) {}
+
+  // seqs: batch x length, lens: lengths or mask, outs: batch x (length + 1), as for kenlm_scores_batch
+  void score(WorkerPool *pool, const TensorView &seqs, const TensorView &lens, const TensorView &outs);
+
+  // forget the stored rows, the next call scores every token
+  void reset() { rows_.clear(); }
+
+  // positions (tokens and </s>) asked for, rescored, and the fraction of LM work saved
+  std::map<std::string, double> get_stats() const;
+  void reset_stats();
+
+  // what is kept of one batch row
+  struct Row
+  {
+    Row() : length(-1), rescored(0) {}
+
+    int32_t length;  // -1 until the row is first scored
+    std::vector<int> tokens;
+    std::vector<lm::ngram::State> states;  // states[t]: before the t-th token, states[0] is <s>
+    std::vector<float> scores;             // scores[t]: of the t-th token, scores[length] of </s>
+    uint64_t rescored;                     // positions rescored by the last call
+  };
+
+private:
+  Scorer *scorer_;
+  std::vector<Row> rows_;
+  uint64_t positions_;
+  uint64_t rescored_;
+};
+
+#endif  // INCREMENTAL_SCORES_H_
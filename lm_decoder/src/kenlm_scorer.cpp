@@ -1,6 +1,10 @@
 #include "kenlm_scorer.h"
 #include <unistd.h>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
 #include <iostream>
+#include <stdexcept>
 
 #include "lm/config.hh"
 #include "lm/model.hh"
@@ -10,14 +14,49 @@
 
 using namespace lm::ngram;
 
-Scorer::Scorer(const std::string &lm_path, const std::vector<std::string> &vocabs)
+// resident and shared (file backed) memory of the process in bytes
+static void read_memory_usage(double &resident, double &shared)
+{
+  resident = shared = 0;
+#ifdef __linux__
+  FILE *statm = fopen("/proc/self/statm", "r");
+  if (statm == nullptr)
+  {
+    return;
+  }
+  unsigned long size_pages = 0, resident_pages = 0, shared_pages = 0;
+  if (fscanf(statm, "%lu %lu %lu", &size_pages, &resident_pages, &shared_pages) == 3)
+  {
+    const double page_size = sysconf(_SC_PAGESIZE);
+    resident = resident_pages * page_size;
+    shared = shared_pages * page_size;
+  }
+  fclose(statm);
+#endif
+}
+
+Scorer::Scorer(const std::string &lm_path,
+               const std::vector<std::string> &vocabs,
+               util::LoadMethod load_method,
+               const std::string &binary_cache_dir,
+               ModelType binary_type,
+               bool restrict_vocab)
 {
 
   language_model_ = nullptr;
+  model_type_ = PROBING;
 
   max_order_ = 0;
   dict_size_ = 0;
-  setup(lm_path, vocabs);
+  end_index_ = 0;
+  load_method_ = load_method;
+  load_seconds_ = 0;
+  binary_cache_ = restricted_ = false;
+  binary_.hit = false;
+  binary_.hash_seconds = binary_.build_seconds = 0;
+  binary_.ngrams = binary_.kept_ngrams = binary_.model_bytes = binary_.kept_model_bytes = 0;
+  rss_before_ = rss_after_ = shared_after_ = 0;
+  setup(lm_path, vocabs, load_method, binary_cache_dir, binary_type, restrict_vocab);
 }
 
 Scorer::~Scorer()
@@ -28,16 +67,54 @@ Scorer::~Scorer()
   }
 }
 
-void Scorer::setup(const std::string &lm_path, const std::vector<std::string> &vocab)
+void Scorer::setup(const std::string &lm_path, const std::vector<std::string> &vocab, util::LoadMethod load_method,
+                   const std::string &binary_cache_dir, ModelType binary_type, bool restrict_vocab)
 {
-  const char *filename = lm_path.c_str();
+  std::string path = lm_path;
+  const bool binary = lm::ngram::RecognizeBinary(path.c_str(), model_type_);
+  if (restrict_vocab && (binary || binary_cache_dir.empty()))
+  {
+    throw std::invalid_argument("restricting the vocabulary needs an ARPA model and a binary cache directory");
+  }
+  if (!binary)
+  {
+    model_type_ = PROBING;
+    if (!binary_cache_dir.empty())
+    {
+      binary_ = cached_binary(lm_path, binary_cache_dir, binary_type,
+                              restrict_vocab ? vocab : std::vector<std::string>());
+      path = binary_.path;
+      model_type_ = binary_type;
+      binary_cache_ = true;
+      restricted_ = restrict_vocab;
+    }
+  }
+
+  const char *filename = path.c_str();
   RetriveStrEnumerateVocab enumerate;
   lm::ngram::Config config;
   config.enumerate_vocab = &enumerate;
-  language_model_ = lm::ngram::LoadVirtual(filename, config);
+  config.load_method = load_method;
+
+  double shared_before;
+  read_memory_usage(rss_before_, shared_before);
+  auto start = std::chrono::steady_clock::now();
+  language_model_ = lm::ngram::LoadVirtual(filename, config, model_type_);
+  load_seconds_ = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  read_memory_usage(rss_after_, shared_after_);
+
   max_order_ = static_cast<lm::base::Model *>(language_model_)->Order();
   vocabulary_ = vocab;
   dict_size_ = vocabulary_.size();
+
+  // resolve every MT word once so that decoding never hashes strings.
+  const lm::base::Vocabulary &lm_vocab = static_cast<lm::base::Model *>(language_model_)->BaseVocabulary();
+  word_indices_.resize(dict_size_);
+  for (size_t i = 0; i < dict_size_; i++)
+  {
+    word_indices_[i] = lm_vocab.Index(vocabulary_[i]);
+  }
+  end_index_ = lm_vocab.EndSentence();
 }
 
 void Scorer::start(State &state)
@@ -49,14 +126,31 @@ void Scorer::start(State &state)
 float Scorer::get_base_log_prob(State &prev_state, const std::string &word, State &out_state)
 {
   lm::base::Model *model = static_cast<lm::base::Model *>(language_model_);
-  lm::WordIndex word_index = model->BaseVocabulary().Index(word);
+  return get_base_log_prob(prev_state, model->BaseVocabulary().Index(word), out_state);
+}
+
+float Scorer::get_base_log_prob(State &prev_state, lm::WordIndex word_index, State &out_state)
+{
+  lm::base::Model *model = static_cast<lm::base::Model *>(language_model_);
   if (word_index == 0){
+    // unknown words break the n-gram context
+    model->NullContextWrite(&out_state);
     return OOV_SCORE;
   }
   float cond_prob = model->BaseScore(&prev_state, word_index, &out_state);
   return cond_prob / NUM_FLT_LOGE;  // log10 --> loge
 }
 
+float Scorer::get_index_log_prob(State &prev_state, const int index, State &out_state)
+{
+  return get_base_log_prob(prev_state, word_indices_[index], out_state);
+}
+
+float Scorer::get_end_log_prob(State &prev_state, State &out_state)
+{
+  return get_base_log_prob(prev_state, end_index_, out_state);
+}
+
 std::string Scorer::get_word(const int index)
 {
   return vocabulary_[index];
@@ -78,6 +172,156 @@ std::vector<float> Scorer::get_sent_log_prob(const std::vector<std::string> &wor
     state = out_state;
     out_state = tmp_state;
   }
-  scores.push_back(get_base_log_prob(state, END_TOKEN, out_state));
+  scores.push_back(get_end_log_prob(state, out_state));
   return scores;
-}
\ No newline at end of file
+}
+
+void Scorer::set_cache(size_t workers, size_t entries)
+{
+  caches_.clear();
+  if (entries == 0)
+  {
+    return;
+  }
+  for (size_t i = 0; i < workers; i++)
+  {
+    caches_.emplace_back(new ScoreCache(entries));
+  }
+}
+
+std::map<std::string, double> Scorer::get_cache_stats() const
+{
+  double hits = 0, misses = 0;
+  for (size_t i = 0; i < caches_.size(); i++)
+  {
+    hits += caches_[i]->hits;
+    misses += caches_[i]->misses;
+  }
+
+  std::map<std::string, double> stats;
+  stats["hits"] = hits;
+  stats["misses"] = misses;
+  stats["hit_rate"] = (hits + misses > 0) ? hits / (hits + misses) : 0;
+  stats["entries"] = caches_.empty() ? 0 : caches_[0]->size();
+  return stats;
+}
+
+void Scorer::set_stats(size_t workers, bool enabled)
+{
+  stats_.clear();
+  if (!enabled)
+  {
+    return;
+  }
+  for (size_t i = 0; i < workers; i++)
+  {
+    stats_.emplace_back(new DecoderStats());
+  }
+}
+
+std::map<std::string, double> Scorer::get_decoder_stats() const
+{
+  DecoderStats total;
+  for (size_t i = 0; i < stats_.size(); i++)
+  {
+    const DecoderStats &worker = *stats_[i];
+    total.lm_lookups += worker.lm_lookups;
+    total.lm_queries += worker.lm_queries;
+    total.oov += worker.oov;
+    total.lm_pruned += worker.lm_pruned;
+    total.sentences += worker.sentences;
+    total.tokens += worker.tokens;
+    total.read_ns += worker.read_ns;
+    total.lm_ns += worker.lm_ns;
+    total.fuse_ns += worker.fuse_ns;
+    total.topk_ns += worker.topk_ns;
+    total.reorder_ns += worker.reorder_ns;
+    total.finish_ns += worker.finish_ns;
+    total.score_ns += worker.score_ns;
+    total.decode_ns += worker.decode_ns;
+    total.queue_ns += worker.queue_ns;
+    for (int b = 0; b < LATENCY_BUCKETS; b++)
+    {
+      total.latency[b] += worker.latency[b];
+    }
+  }
+
+  std::map<std::string, double> stats;
+  stats["enabled"] = !stats_.empty();
+  stats["lm_lookups"] = total.lm_lookups;
+  stats["lm_queries"] = total.lm_queries;
+  stats["oov"] = total.oov;
+  stats["lm_pruned"] = total.lm_pruned;
+  stats["lm_pruned_per_sentence"] = total.sentences > 0 ? double(total.lm_pruned) / total.sentences : 0;
+  stats["sentences"] = total.sentences;
+  stats["tokens"] = total.tokens;
+  stats["read_seconds"] = total.read_ns * 1e-9;
+  stats["lm_seconds"] = total.lm_ns * 1e-9;
+  stats["fuse_seconds"] = total.fuse_ns * 1e-9;
+  stats["topk_seconds"] = total.topk_ns * 1e-9;
+  stats["reorder_seconds"] = total.reorder_ns * 1e-9;
+  stats["finish_seconds"] = total.finish_ns * 1e-9;
+  stats["score_seconds"] = total.score_ns * 1e-9;
+  stats["decode_seconds"] = total.decode_ns * 1e-9;
+  stats["queue_wait_seconds"] = total.queue_ns * 1e-9;
+
+  // histogram as latency_us_<upper bound of the bucket>, and percentiles as bucket upper bounds
+  uint64_t seen = 0;
+  stats["latency_p50_us"] = stats["latency_p99_us"] = 0;
+  for (int b = 0; b < LATENCY_BUCKETS; b++)
+  {
+    const double upper = (b == LATENCY_BUCKETS - 1) ? INFINITY : double(2ULL << b);
+    stats["latency_us_" + (b == LATENCY_BUCKETS - 1 ? std::string("inf") : std::to_string(2ULL << b))] =
+        total.latency[b];
+    seen += total.latency[b];
+    if (total.latency[b] > 0 && stats["latency_p50_us"] == 0 && seen * 2 >= total.sentences)
+    {
+      stats["latency_p50_us"] = upper;
+    }
+    if (total.latency[b] > 0 && stats["latency_p99_us"] == 0 && seen * 100 >= total.sentences * 99)
+    {
+      stats["latency_p99_us"] = upper;
+    }
+  }
+  return stats;
+}
+
+void Scorer::reset_decoder_stats()
+{
+  for (size_t i = 0; i < stats_.size(); i++)
+  {
+    stats_[i]->reset();
+  }
+}
+
+std::map<std::string, double> Scorer::get_load_stats() const
+{
+  std::map<std::string, double> stats;
+  stats["load_method"] = load_method_;
+  stats["load_seconds"] = load_seconds_;
+  stats["rss_bytes"] = rss_after_;
+  stats["rss_delta_bytes"] = rss_after_ - rss_before_;
+  stats["shared_bytes"] = shared_after_;
+  stats["binary_cache"] = binary_cache_;
+  stats["binary_cache_hit"] = binary_.hit;
+  stats["hash_seconds"] = binary_.hash_seconds;
+  stats["build_seconds"] = binary_.build_seconds;
+  stats["restricted"] = restricted_;
+  if (restricted_)
+  {
+    stats["ngrams"] = binary_.ngrams;
+    stats["kept_ngrams"] = binary_.kept_ngrams;
+    stats["model_bytes"] = binary_.model_bytes;
+    stats["kept_model_bytes"] = binary_.kept_model_bytes;
+  }
+  return stats;
+}
+
+void Scorer::reset_cache_stats()
+{
+  for (size_t i = 0; i < caches_.size(); i++)
+  {
+    caches_[i]->hits = 0;
+    caches_[i]->misses = 0;
+  }
+}
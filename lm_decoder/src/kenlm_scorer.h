@@ -1,19 +1,27 @@
 #ifndef KENLM_SCORER_H_
 #define KENLM_SCORER_H_
 
+#include <limits>
+#include <map>
 #include <memory>
 #include <string>
 #include <unordered_map>
 #include <vector>
 
+#include "lm/binary_format.hh"
 #include "lm/config.hh"
 #include "lm/model.hh"
 #include "lm/state.hh"
 #include "lm/enumerate_vocab.hh"
+#include "lm/lm_exception.hh"
 #include "lm/virtual_interface.hh"
 #include "lm/word_index.hh"
 #include "util/string_piece.hh"
 
+#include "binary_cache.h"
+#include "decoder_stats.h"
+#include "score_cache.h"
+
 const double OOV_SCORE = -1000.0;
 const std::string START_TOKEN = "<s>";
 const std::string UNK_TOKEN = "<unk>";
@@ -37,11 +45,34 @@ public:
   std::vector<std::string> vocabulary;
 };
 
-/* External scorer to query score for n-gram or sentence. */
+/* External scorer to query score for n-gram or sentence.
+ *
+ * load_method only applies to binary models (ARPA files are always parsed into memory):
+ *   LAZY:              mmap, pages are faulted in by the first queries
+ *   POPULATE_OR_LAZY:  mmap with MAP_POPULATE on Linux, lazy elsewhere
+ *   POPULATE_OR_READ:  mmap with MAP_POPULATE on Linux, malloc and read elsewhere (KenLM default)
+ *   READ:              malloc and read a private copy
+ *   PARALLEL_READ:     malloc and read a private copy with several threads
+ * The mmap methods map the file shared and read-only, so every process that
+ * loads the same binary this way uses the same page cache copy of the model.
+ * READ / PARALLEL_READ allocate with MAP_HUGETLB when huge pages are
+ * reserved, falling back to transparent huge pages.
+ *
+ * Given a binary_cache_dir, ARPA files are compiled once into a binary of
+ * binary_type (PROBING, TRIE or QUANT_TRIE) kept there (see binary_cache.h),
+ * which is then loaded with load_method like any binary model. With
+ * restrict_vocab, that binary only keeps the n-grams made of the MT
+ * vocabulary: the decoder's lookups score the same, words outside of it
+ * become unknown to the string based methods. */
 class Scorer {
 
 public:
-  Scorer(const std::string &lm_path, const std::vector<std::string> &vocabs);
+  Scorer(const std::string &lm_path,
+         const std::vector<std::string> &vocabs,
+         util::LoadMethod load_method = util::POPULATE_OR_READ,
+         const std::string &binary_cache_dir = "",
+         ModelType binary_type = PROBING,
+         bool restrict_vocab = false);
   ~Scorer();
 
   // return the max order
@@ -50,19 +81,193 @@ public:
   // return the dictionary size of language model
   size_t get_dict_size() const { return dict_size_; }
 
+  // return the concrete KenLM model type (ARPA files are loaded as probing models)
+  ModelType get_model_type() const { return model_type_; }
+
+  // return the loaded model as its concrete type, Model must match get_model_type()
+  template <class Model>
+  const Model *get_model() const
+  {
+    return static_cast<const Model *>(static_cast<const lm::base::Model *>(language_model_));
+  }
+
+  // return the MT vocabulary the scorer was built on
+  const std::vector<std::string> &get_vocabulary() const { return vocabulary_; }
+
+  // return the KenLM index of the index-th MT word (0 if it is OOV)
+  lm::WordIndex get_word_index(const int index) const { return word_indices_[index]; }
+
   void start(State &state);
   float get_base_log_prob(State &prev_state, const std::string &word, State &out_state);
+  float get_base_log_prob(State &prev_state, lm::WordIndex word_index, State &out_state);
+  float get_index_log_prob(State &prev_state, const int index, State &out_state);
+  float get_end_log_prob(State &prev_state, State &out_state);
   std::vector<float> get_sent_log_prob(const std::vector<std::string> &words);
   std::string get_word(const int index);
 
+  // non-virtual variants of the above for the hot decoding loops,
+  // lookups go through the worker's cache when one is given and are counted in stats if given.
+  template <class Model>
+  float get_base_log_prob(const State &prev_state, lm::WordIndex word_index, State &out_state,
+                          ScoreCache *cache = nullptr, DecoderStats *stats = nullptr) const;
+  template <class Model>
+  float get_index_log_prob(const State &prev_state, const int index, State &out_state,
+                           ScoreCache *cache = nullptr, DecoderStats *stats = nullptr) const
+  {
+    return get_base_log_prob<Model>(prev_state, word_indices_[index], out_state, cache, stats);
+  }
+  template <class Model>
+  float get_end_log_prob(const State &prev_state, State &out_state, ScoreCache *cache = nullptr,
+                         DecoderStats *stats = nullptr) const
+  {
+    return get_base_log_prob<Model>(prev_state, end_index_, out_state, cache, stats);
+  }
+
+  // (re)build one cache of the given number of entries per worker, 0 disables caching.
+  // must not be called while decoding.
+  void set_cache(size_t workers, size_t entries);
+
+  // return the cache of the given worker, nullptr if caching is disabled
+  ScoreCache *get_cache(size_t worker)
+  {
+    return worker < caches_.size() ? caches_[worker].get() : nullptr;
+  }
+
+  // hits / misses / hit_rate summed over the workers.
+  // must not be called while decoding, the workers update them without locks.
+  std::map<std::string, double> get_cache_stats() const;
+  void reset_cache_stats();
+
+  // (re)create the decoding statistics of each worker, or turn them off.
+  // must not be called while decoding.
+  void set_stats(size_t workers, bool enabled);
+
+  // return the statistics of the given worker, nullptr if they are off
+  DecoderStats *get_stats(size_t worker)
+  {
+    return worker < stats_.size() ? stats_[worker].get() : nullptr;
+  }
+
+  // counters, stage times (seconds) and latency percentiles summed over the workers.
+  // must not be called while decoding, the workers update them without locks.
+  std::map<std::string, double> get_decoder_stats() const;
+  void reset_decoder_stats();
+
+  // load_seconds, and the resident / shared memory of the process (bytes) after loading
+  // together with the growth of the resident memory during the load (Linux only, 0 elsewhere).
+  // binary_cache is 1 when an ARPA file went through the binary cache, with binary_cache_hit,
+  // hash_seconds and build_seconds (0 on a hit). restricted is 1 with restrict_vocab, with the n-grams
+  // (ngrams / kept_ngrams) and in-memory size (model_bytes / kept_model_bytes) of the full and loaded models.
+  std::map<std::string, double> get_load_stats() const;
+
 protected:
-  void setup(const std::string &lm_path, const std::vector<std::string> &vocab);
+  void setup(const std::string &lm_path, const std::vector<std::string> &vocab, util::LoadMethod load_method,
+             const std::string &binary_cache_dir, ModelType binary_type, bool restrict_vocab);
+
+  template <class Model>
+  float query(const State &prev_state, lm::WordIndex word_index, State &out_state) const;
 
 private:
   void *language_model_;
+  ModelType model_type_;
   size_t max_order_;
   size_t dict_size_;
   std::vector<std::string> vocabulary_;
+
+  // MT vocabulary --> KenLM vocabulary, resolved once in setup()
+  std::vector<lm::WordIndex> word_indices_;
+  lm::WordIndex end_index_;
+
+  // one cache per worker, so that lookups never contend
+  std::vector<std::unique_ptr<ScoreCache>> caches_;
+  std::vector<std::unique_ptr<DecoderStats>> stats_;
+
+  util::LoadMethod load_method_;
+  double load_seconds_;
+  bool binary_cache_;
+  bool restricted_;
+  CachedBinary binary_;
+  double rss_before_;
+  double rss_after_;
+  double shared_after_;
 };
 
+template <class Model>
+inline float Scorer::get_base_log_prob(const State &prev_state, lm::WordIndex word_index, State &out_state,
+                                       ScoreCache *cache, DecoderStats *stats) const
+{
+  if (stats != nullptr)
+  {
+    stats->lm_lookups++;
+    stats->oov += (word_index == 0);
+  }
+  if (cache == nullptr)
+  {
+    if (stats != nullptr)
+    {
+      stats->lm_queries++;
+    }
+    return query<Model>(prev_state, word_index, out_state);
+  }
+
+  ScoreCache::Entry &entry = cache->slot(prev_state, word_index);
+  if (ScoreCache::matches(entry, prev_state, word_index))
+  {
+    cache->hits++;
+  }
+  else
+  {
+    cache->misses++;
+    if (stats != nullptr)
+    {
+      stats->lm_queries++;
+    }
+    entry.log_prob = query<Model>(prev_state, word_index, entry.out_state);
+    entry.context = prev_state;
+    entry.word = word_index;
+  }
+  out_state = entry.out_state;
+  return entry.log_prob;
+}
+
+template <class Model>
+inline float Scorer::query(const State &prev_state, lm::WordIndex word_index, State &out_state) const
+{
+  const Model *model = get_model<Model>();
+  if (word_index == 0){
+    // unknown words break the n-gram context
+    out_state = model->NullContextState();
+    return OOV_SCORE;
+  }
+  float cond_prob = model->FullScore(prev_state, word_index, out_state).prob;
+  return cond_prob / NUM_FLT_LOGE;  // log10 --> loge
+}
+
+/* Call Functor::apply<Model>(args...) with the concrete model type of the scorer.
+ * Dispatching once per call lets the whole decoding loop be instantiated per
+ * model type, so that KenLM lookups are inlined instead of going through
+ * lm::base::Model's virtual interface. */
+template <class Functor, class... Args>
+auto dispatch_model(const Scorer *scorer, Args &&... args)
+    -> decltype(Functor::template apply<ProbingModel>(std::forward<Args>(args)...))
+{
+  switch (scorer->get_model_type())
+  {
+  case PROBING:
+    return Functor::template apply<ProbingModel>(std::forward<Args>(args)...);
+  case REST_PROBING:
+    return Functor::template apply<RestProbingModel>(std::forward<Args>(args)...);
+  case TRIE:
+    return Functor::template apply<TrieModel>(std::forward<Args>(args)...);
+  case QUANT_TRIE:
+    return Functor::template apply<QuantTrieModel>(std::forward<Args>(args)...);
+  case ARRAY_TRIE:
+    return Functor::template apply<ArrayTrieModel>(std::forward<Args>(args)...);
+  case QUANT_ARRAY_TRIE:
+    return Functor::template apply<QuantArrayTrieModel>(std::forward<Args>(args)...);
+  default:
+    UTIL_THROW(lm::FormatLoadException, "Confused by model type " << scorer->get_model_type());
+  }
+}
+
 #endif  // KENLM_SCORER_H_
\ No newline at end of file
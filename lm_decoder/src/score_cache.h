@@ -0,0 +1,65 @@
+#ifndef SCORE_CACHE_H_
+#define SCORE_CACHE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+#include "lm/state.hh"
+#include "lm/word_index.hh"
+
+/* Bounded (KenLM state, word) --> (log prob, out state) cache.
+ * It is direct-mapped on hash_value(state, word) and owned by a single
+ * worker, so lookups take no lock.  Beams that share a truncated n-gram
+ * context then hit the cache instead of KenLM's tables. */
+class ScoreCache {
+
+public:
+  struct Entry {
+    lm::ngram::State context;
+    lm::ngram::State out_state;
+    lm::WordIndex word;
+    float log_prob;
+  };
+
+  // entries is rounded up to a power of two
+  explicit ScoreCache(size_t entries)
+      : hits(0), misses(0)
+  {
+    size_t size = 1;
+    while (size < entries)
+    {
+      size <<= 1;
+    }
+    mask_ = size - 1;
+
+    Entry empty;
+    empty.context.length = 0;
+    empty.word = std::numeric_limits<lm::WordIndex>::max();  // never a real word
+    entries_.assign(size, empty);
+  }
+
+  size_t size() const { return entries_.size(); }
+
+  // return the slot for (state, word), its content is valid if matches() holds
+  Entry &slot(const lm::ngram::State &state, lm::WordIndex word)
+  {
+    return entries_[hash_value(state, word) & mask_];
+  }
+
+  static bool matches(const Entry &entry, const lm::ngram::State &state, lm::WordIndex word)
+  {
+    return entry.word == word && entry.context == state;
+  }
+
+  // statistics, only touched by the owning worker
+  uint64_t hits;
+  uint64_t misses;
+
+private:
+  std::vector<Entry> entries_;
+  size_t mask_;
+};
+
+#endif  // SCORE_CACHE_H_
@@ -0,0 +1,228 @@
+#ifndef TENSOR_VIEW_H_
+#define TENSOR_VIEW_H_
+
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+/* Non-owning, strided view of a CPU tensor.
+ * The decoder reads its inputs and writes its outputs through views, so the
+ * caller's tensors are used as they are: no dtype conversion and no copy to
+ * make them contiguous. */
+
+enum class DType { Bool, UInt8, Int32, Int64, Float16, BFloat16, Float32, Float64 };
+
+const int TENSOR_VIEW_MAX_DIMS = 3;
+
+inline float half_to_float(uint16_t h)
+{
+  const uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+  uint32_t exponent = (h >> 10) & 0x1f;
+  uint32_t mantissa = h & 0x3ff;
+  uint32_t bits;
+  if (exponent == 0x1f)
+  {
+    bits = sign | 0x7f800000 | (mantissa << 13);  // inf / nan
+  }
+  else if (exponent != 0)
+  {
+    bits = sign | ((exponent + 112) << 23) | (mantissa << 13);
+  }
+  else if (mantissa == 0)
+  {
+    bits = sign;
+  }
+  else
+  {
+    // subnormal half, renormalise
+    exponent = 113;
+    while ((mantissa & 0x400) == 0)
+    {
+      mantissa <<= 1;
+      exponent--;
+    }
+    bits = sign | (exponent << 23) | ((mantissa & 0x3ff) << 13);
+  }
+  float f;
+  std::memcpy(&f, &bits, sizeof(f));
+  return f;
+}
+
+inline float bfloat16_to_float(uint16_t b)
+{
+  const uint32_t bits = (uint32_t)b << 16;
+  float f;
+  std::memcpy(&f, &bits, sizeof(f));
+  return f;
+}
+
+struct TensorView
+{
+  void *data;
+  DType dtype;
+  int dim;
+  int64_t sizes[TENSOR_VIEW_MAX_DIMS];
+  int64_t strides[TENSOR_VIEW_MAX_DIMS];  // in elements
+
+  int64_t size(int d) const { return sizes[d]; }
+
+  int64_t offset(int64_t i) const { return i * strides[0]; }
+  int64_t offset(int64_t i, int64_t j) const { return i * strides[0] + j * strides[1]; }
+  int64_t offset(int64_t i, int64_t j, int64_t k) const
+  {
+    return i * strides[0] + j * strides[1] + k * strides[2];
+  }
+
+  float get_float(int64_t offset) const
+  {
+    switch (dtype)
+    {
+    case DType::Bool:
+    case DType::UInt8:
+      return static_cast<const uint8_t *>(data)[offset];
+    case DType::Int32:
+      return static_cast<const int32_t *>(data)[offset];
+    case DType::Int64:
+      return static_cast<const int64_t *>(data)[offset];
+    case DType::Float16:
+      return half_to_float(static_cast<const uint16_t *>(data)[offset]);
+    case DType::BFloat16:
+      return bfloat16_to_float(static_cast<const uint16_t *>(data)[offset]);
+    case DType::Float32:
+      return static_cast<const float *>(data)[offset];
+    case DType::Float64:
+      return static_cast<const double *>(data)[offset];
+    }
+    return 0;
+  }
+
+  int64_t get_int(int64_t offset) const
+  {
+    switch (dtype)
+    {
+    case DType::Bool:
+    case DType::UInt8:
+      return static_cast<const uint8_t *>(data)[offset];
+    case DType::Int32:
+      return static_cast<const int32_t *>(data)[offset];
+    case DType::Int64:
+      return static_cast<const int64_t *>(data)[offset];
+    default:
+      return static_cast<int64_t>(get_float(offset));
+    }
+  }
+
+  // read n elements starting at offset, step elements apart, as floats / ints.
+  // the dtype switch is taken once per row rather than once per element.
+  void read_floats(int64_t offset, int64_t step, int n, float *out) const
+  {
+    switch (dtype)
+    {
+    case DType::Float32:
+      read_row(static_cast<const float *>(data) + offset, step, n, out);
+      break;
+    case DType::Float16:
+      for (int i = 0; i < n; i++)
+      {
+        out[i] = half_to_float(static_cast<const uint16_t *>(data)[offset + i * step]);
+      }
+      break;
+    case DType::BFloat16:
+      for (int i = 0; i < n; i++)
+      {
+        out[i] = bfloat16_to_float(static_cast<const uint16_t *>(data)[offset + i * step]);
+      }
+      break;
+    case DType::Float64:
+      read_row(static_cast<const double *>(data) + offset, step, n, out);
+      break;
+    default:
+      for (int i = 0; i < n; i++)
+      {
+        out[i] = get_float(offset + i * step);
+      }
+    }
+  }
+
+  void read_ints(int64_t offset, int64_t step, int n, int *out) const
+  {
+    switch (dtype)
+    {
+    case DType::Int64:
+      read_row(static_cast<const int64_t *>(data) + offset, step, n, out);
+      break;
+    case DType::Int32:
+      read_row(static_cast<const int32_t *>(data) + offset, step, n, out);
+      break;
+    default:
+      for (int i = 0; i < n; i++)
+      {
+        out[i] = static_cast<int>(get_int(offset + i * step));
+      }
+    }
+  }
+
+  void set_float(int64_t offset, float value) const
+  {
+    switch (dtype)
+    {
+    case DType::Float32:
+      static_cast<float *>(data)[offset] = value;
+      break;
+    case DType::Float64:
+      static_cast<double *>(data)[offset] = value;
+      break;
+    default:
+      throw std::invalid_argument("float outputs must be float32 or float64");
+    }
+  }
+
+  void set_int(int64_t offset, int64_t value) const
+  {
+    switch (dtype)
+    {
+    case DType::Int64:
+      static_cast<int64_t *>(data)[offset] = value;
+      break;
+    case DType::Int32:
+      static_cast<int32_t *>(data)[offset] = static_cast<int32_t>(value);
+      break;
+    default:
+      throw std::invalid_argument("index outputs must be int32 or int64");
+    }
+  }
+
+  // number of non-zero entries of row i of a 2-d view (the length from a mask)
+  int64_t count_nonzero(int64_t i) const
+  {
+    int64_t count = 0;
+    for (int64_t j = 0; j < sizes[1]; j++)
+    {
+      count += (get_float(offset(i, j)) != 0);
+    }
+    return count;
+  }
+
+private:
+  template <typename From, typename To>
+  static void read_row(const From *row, int64_t step, int n, To *out)
+  {
+    if (step == 1)
+    {
+      for (int i = 0; i < n; i++)
+      {
+        out[i] = static_cast<To>(row[i]);
+      }
+    }
+    else
+    {
+      for (int i = 0; i < n; i++)
+      {
+        out[i] = static_cast<To>(row[i * step]);
+      }
+    }
+  }
+};
+
+#endif  // TENSOR_VIEW_H_
@@ -0,0 +1,226 @@
+#include "worker_pool.h"
+
+#include <algorithm>
+#include <chrono>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+WorkerPool::Job::Job(size_t n, size_t grain, size_t workers, const ChunkFunction &fn)
+    : fn_(fn), size_(n), grain_(grain), workers_(std::max<size_t>(workers, 1)), next_(0), remaining_(n)
+{
+}
+
+bool WorkerPool::Job::claim(size_t &begin, size_t &end)
+{
+  if (grain_ != 0)
+  {
+    begin = next_.fetch_add(grain_);
+    if (begin >= size_)
+    {
+      return false;
+    }
+    end = std::min(begin + grain_, size_);
+    return true;
+  }
+
+  begin = next_.load();
+  do
+  {
+    if (begin >= size_)
+    {
+      return false;
+    }
+    end = begin + std::max<size_t>((size_ - begin) / (2 * workers_), 1);
+  } while (!next_.compare_exchange_weak(begin, end));
+  return true;
+}
+
+bool WorkerPool::Job::run_chunk(size_t worker, std::atomic<uint64_t> &busy)
+{
+  size_t begin, end;
+  if (!claim(begin, end))
+  {
+    return false;
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  try
+  {
+    fn_(worker, begin, end);
+  }
+  catch (...)
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (!error_)
+    {
+      error_ = std::current_exception();
+    }
+  }
+  busy.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                     std::chrono::steady_clock::now() - start).count(),
+                 std::memory_order_relaxed);
+
+  if (remaining_.fetch_sub(end - begin) == end - begin)
+  {
+    // taking the lock orders the notification after a waiter that saw items left went to sleep
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+    }
+    finished_.notify_all();
+  }
+  return true;
+}
+
+void WorkerPool::Job::wait()
+{
+  std::unique_lock<std::mutex> lock(mutex_);
+  finished_.wait(lock, [this] { return remaining_ == 0; });
+  if (error_)
+  {
+    std::rethrow_exception(error_);
+  }
+}
+
+bool WorkerPool::Job::done()
+{
+  return remaining_ == 0;
+}
+
+WorkerPool::WorkerPool(size_t workers, bool pin_cpus)
+    : stop_(false)
+{
+  workers = std::max<size_t>(workers, 1);
+  busy_.reset(new std::atomic<uint64_t>[workers]);
+  for (size_t i = 0; i < workers; i++)
+  {
+    busy_[i] = 0;
+  }
+#ifdef __linux__
+  // the CPUs the process may run on (taskset, cgroup cpusets), not all those of the machine
+  std::vector<int> cpus;
+  if (pin_cpus)
+  {
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(cpu_set_t), &allowed) == 0)
+    {
+      for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+      {
+        if (CPU_ISSET(cpu, &allowed))
+        {
+          cpus.push_back(cpu);
+        }
+      }
+    }
+  }
+#endif
+  for (size_t i = 0; i < workers; i++)
+  {
+    workers_.emplace_back(&WorkerPool::run, this, i);
+#ifdef __linux__
+    if (!cpus.empty())
+    {
+      cpu_set_t cpu_set;
+      CPU_ZERO(&cpu_set);
+      CPU_SET(cpus[i % cpus.size()], &cpu_set);
+      // pinning is only a hint: a worker that cannot be pinned keeps the affinity of the process
+      (void)pthread_setaffinity_np(workers_[i].native_handle(), sizeof(cpu_set_t), &cpu_set);
+    }
+#endif
+  }
+}
+
+WorkerPool::~WorkerPool()
+{
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  condition_.notify_all();
+  for (std::thread &worker : workers_)
+  {
+    worker.join();
+  }
+}
+
+std::shared_ptr<WorkerPool::Job> WorkerPool::submit(size_t n, size_t grain, const ChunkFunction &fn)
+{
+  std::shared_ptr<Job> job = std::make_shared<Job>(n, grain, size(), fn);
+  if (n == 0)
+  {
+    return job;
+  }
+
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    jobs_.push_back(job);
+  }
+  // a guided job has at least min(n, 2 * workers) chunks
+  size_t chunks = grain == 0 ? n : (n + grain - 1) / grain;
+  if (chunks >= size())
+  {
+    condition_.notify_all();
+  }
+  else
+  {
+    for (size_t i = 0; i < chunks; i++)
+    {
+      condition_.notify_one();
+    }
+  }
+  return job;
+}
+
+void WorkerPool::parallel_for(size_t n, size_t grain, const ChunkFunction &fn)
+{
+  submit(n, grain, fn)->wait();
+}
+
+std::vector<double> WorkerPool::busy_time() const
+{
+  std::vector<double> seconds(size());
+  for (size_t i = 0; i < size(); i++)
+  {
+    seconds[i] = busy_[i].load(std::memory_order_relaxed) * 1e-9;
+  }
+  return seconds;
+}
+
+void WorkerPool::reset_busy_time()
+{
+  for (size_t i = 0; i < size(); i++)
+  {
+    busy_[i] = 0;
+  }
+}
+
+void WorkerPool::run(size_t worker)
+{
+  for (;;)
+  {
+    std::shared_ptr<Job> job;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      condition_.wait(lock, [this] { return stop_ || !jobs_.empty(); });
+      if (stop_ && jobs_.empty())
+      {
+        return;
+      }
+      job = jobs_.front();
+    }
+
+    while (job->run_chunk(worker, busy_[worker]))
+    {
+    }
+
+    // every chunk is claimed, retire the job so that the next one is picked up
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (!jobs_.empty() && jobs_.front() == job)
+    {
+      jobs_.pop_front();
+    }
+  }
+}
@@ -0,0 +1,90 @@
+#ifndef WORKER_POOL_H_
+#define WORKER_POOL_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// fn(worker, begin, end) processes the items [begin, end) on the given worker
+typedef std::function<void(size_t, size_t, size_t)> ChunkFunction;
+
+/* Long-lived pool of decoding threads.
+ * Work is submitted as jobs over [0, n) that the workers split into chunks
+ * by bumping an atomic cursor, so the queue lock is taken once per job
+ * instead of once per sentence. */
+class WorkerPool {
+
+public:
+  // A submitted parallel_for, can be waited on from any thread.
+  class Job {
+  public:
+    // grain 0 is guided: each chunk takes a share of what is left, from n / (2 * workers) down to one item
+    Job(size_t n, size_t grain, size_t workers, const ChunkFunction &fn);
+
+    // block until every chunk has run, rethrowing the first error if any
+    void wait();
+    bool done();
+
+  private:
+    friend class WorkerPool;
+
+    // claim and run the next chunk, adding its run time to busy;
+    // return false once every chunk is claimed
+    bool run_chunk(size_t worker, std::atomic<uint64_t> &busy);
+
+    // claim [begin, end) from the cursor, false once it is past the end
+    bool claim(size_t &begin, size_t &end);
+
+    ChunkFunction fn_;
+    size_t size_;
+    size_t grain_;
+    size_t workers_;
+    std::atomic<size_t> next_;
+
+    // items not yet run: the mutex is only taken by the chunk that brings it to zero, and on errors
+    std::atomic<size_t> remaining_;
+    std::mutex mutex_;
+    std::condition_variable finished_;
+    std::exception_ptr error_;
+  };
+
+  WorkerPool(size_t workers, bool pin_cpus = false);
+  ~WorkerPool();
+
+  // return the number of worker threads
+  size_t size() const { return workers_.size(); }
+
+  // queue fn over [0, n) in chunks of grain items (0: guided, large chunks first then smaller ones,
+  // so that the longest-first orders of the decoders end on single sentences)
+  std::shared_ptr<Job> submit(size_t n, size_t grain, const ChunkFunction &fn);
+
+  // submit and wait
+  void parallel_for(size_t n, size_t grain, const ChunkFunction &fn);
+
+  // seconds each worker spent running chunks since the pool was created or last reset
+  std::vector<double> busy_time() const;
+  void reset_busy_time();
+
+private:
+  void run(size_t worker);
+
+  std::vector<std::thread> workers_;
+  std::deque<std::shared_ptr<Job>> jobs_;
+
+  // nanoseconds, each slot is only written by its worker
+  std::unique_ptr<std::atomic<uint64_t>[]> busy_;
+
+  std::mutex mutex_;
+  std::condition_variable condition_;
+  bool stop_;
+};
+
+#endif  // WORKER_POOL_H_
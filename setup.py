@@ -52,6 +52,6 @@ setup(
     # Exclude the build files.
     packages=find_packages(exclude=["build"]),
     ext_modules = [build.extension],
-    cmdclass={'build_ext': BuildExtension}
+    cmdclass={'build_ext': BuildExtension, 'build_benchmark': build.BuildBenchmark}
 )
 
@@ -1,13 +1,21 @@
+import os
+import random
+import shutil
+import tempfile
 import unittest
 import torch
 import lm_decoder
 
+# KenLM's bundled test model, set LM_DECODER_TEST_LM to time a real one
+DEFAULT_LM = os.path.join(os.path.dirname(os.path.abspath(__file__)), '..', 'third_party', 'kenlm', 'lm', 'test.arpa')
+
+
 class Test(unittest.TestCase):
 
     def setUp(self):
-        model_path = "/private/home/jgu/data/wmt16/en-de/lm/lm.train.bpe.4gram.de.bin"
-        self.vocab = ['<init>', '<eos>'] + 'Frau Präsidentin , zur Geschäftsordnung .'.split()
-        self.decoder = lm_decoder.KenLMDecoder(model_path=model_path, vocab=self.vocab, beam_width=2)
+        self.model_path = os.environ.get('LM_DECODER_TEST_LM', DEFAULT_LM)
+        self.vocab = ['<init>', '<eos>'] + 'i would consider looking a little more on the screening .'.split()
+        self.decoder = lm_decoder.KenLMDecoder(model_path=self.model_path, vocab=self.vocab, workers=4)
 
     def test_a(self):
         import time
@@ -16,13 +24,215 @@ class Test(unittest.TestCase):
             seqs  = torch.LongTensor([[[4, 2], [6, 3], [4, 5], [5, 1], [5, 6]]])
             masks = torch.ByteTensor([[1, 1, 1, 1, 1]])
             probs = torch.FloatTensor([[[0.7, 0.2], [0.3, 0.3], [0.4, 0.2], [0.6, 0.2], [0.2, 0.2]]])
-            lens = masks.sum(1)
 
-            seqs = seqs.expand(20, 5, 2)
-            probs = probs.expand(20, 5, 2)
-            lens = lens.expand(20)
-            seqss, scores = self.decoder.test(seqs, probs, lens)
+            # spread the candidates over the vocabulary, the decoder takes the short list itself
+            mt_probs = torch.zeros(1, 5, len(self.vocab)).scatter_(2, seqs, probs)
+            mt_probs = mt_probs.expand(20, 5, len(self.vocab))
+            masks = masks.expand(20, 5)
+            gates = torch.full((20, 5), 0.5)
+            scores, seqss = self.decoder.beam_search_with_language_model(
+                mt_probs, gates, masks, short_list=2, beam_size=2)
             #print(seqss[0], scores)
         print(time.time() - t)
+
+        self.assertEqual(scores.size(), (20, 2))
+        self.assertTrue(bool((scores[:, 0] >= scores[:, 1]).all()))
+
+    def _masks(self, lengths, length):
+        return (torch.arange(length).unsqueeze(0) < lengths.unsqueeze(1)).to(torch.uint8)
+
+    def _random_batch(self, seed, batch=12, length=10):
+        # MT distributions, gates and masks of a batch with an empty row and a full-length one
+        generator = torch.Generator().manual_seed(seed)
+        mt_probs = torch.softmax(torch.randn(batch, length, len(self.vocab), generator=generator), 2)
+        gates = torch.rand(batch, length, generator=generator)
+        lengths = torch.randint(1, length + 1, (batch,), generator=generator)
+        lengths[0] = 0
+        lengths[1] = length
+        return mt_probs, gates, self._masks(lengths, length)
+
+    def test_input_dtypes_and_strides(self):
+        # inputs are read in place: other dtypes and layouts decode as their float32 / int32 / contiguous copies
+        mt_probs, gates, masks = self._random_batch(7)
+        probs, seqs = mt_probs.topk(6, 2)
+        seqs = seqs.int()
+
+        def decode(probs, seqs, gates, masks):
+            out_seqs = torch.zeros(seqs.size(), dtype=torch.long)
+            scores = torch.empty(seqs.size(0), 3)
+            lm_decoder.lm_decoder.beam_search(self.decoder.lm_scorer, self.decoder.pool, probs, seqs, gates, masks,
+                                              out_seqs, scores, 3, 0, -1.0)
+            return scores, out_seqs
+
+        def assert_same(results, expected):
+            self.assertTrue(torch.equal(results[0], expected[0]))
+            self.assertTrue(torch.equal(results[1], expected[1]))
+
+        expected = decode(probs, seqs, gates, masks)
+        for dtype in [torch.float16, torch.bfloat16]:
+            rounded = probs.to(dtype)
+            assert_same(decode(rounded, seqs, gates, masks), decode(rounded.float(), seqs, gates, masks))
+        assert_same(decode(probs, seqs.long(), gates, masks), expected)
+        strided = [t.transpose(0, -1).contiguous().transpose(0, -1) for t in (probs, seqs, gates, masks)]
+        self.assertFalse(strided[0].is_contiguous())
+        assert_same(decode(*strided), expected)
+
+    def test_rejects_bad_shapes(self):
+        mt_probs, gates, masks = self._random_batch(8)
+        with self.assertRaises(ValueError):
+            self.decoder.beam_search_with_language_model(mt_probs, gates[:, 0], masks, short_list=6, beam_size=3)
+        with self.assertRaises(ValueError):
+            self.decoder.beam_search_with_language_model(mt_probs, gates[:, 1:], masks, short_list=6, beam_size=3)
+        with self.assertRaises(ValueError):
+            self.decoder.beam_search_with_language_model(mt_probs, gates, masks, short_list=6, beam_size=3,
+                                                         out_scores=torch.empty(masks.size(0), 4))
+        with self.assertRaises(ValueError):
+            self.decoder.beam_search_with_language_model(mt_probs, gates, masks, short_list=2, beam_size=3)
+
+    def test_prune_margin_exact(self):
+        # "bar" has a positive backoff in test.arpa, LM probabilities after it can be above 1
+        vocab = self.vocab + ['bar']
+        decoder = lm_decoder.KenLMDecoder(model_path=self.model_path, vocab=vocab, workers=4)
+        generator = torch.Generator().manual_seed(14)
+        mt_probs = torch.softmax(torch.randn(12, 10, len(vocab), generator=generator), 2)
+        gates = torch.rand(12, 10, generator=generator)
+        masks = torch.ones(12, 10, dtype=torch.uint8)
+        for type in ['moe', 'shallow']:
+            scores, seqs = decoder.beam_search_with_language_model(
+                mt_probs, gates, masks, short_list=6, beam_size=3, type=type)
+            pruned_scores, pruned_seqs = decoder.beam_search_with_language_model(
+                mt_probs, gates, masks, short_list=6, beam_size=3, type=type, prune_margin=0)
+            self.assertTrue(torch.equal(scores, pruned_scores))
+            self.assertTrue(torch.equal(seqs, pruned_seqs))
+
+    def test_single_model_ensemble(self):
+        # an ensemble of one model with weight 1 scores exactly as that model, empty rows included
+        mt_probs, gates, masks = self._random_batch(15)
+        targets = mt_probs.argmax(2)
+        for interpolation in ['linear', 'log_linear']:
+            ensemble = lm_decoder.KenLMDecoder(model_path=[self.model_path], vocab=self.vocab, workers=4,
+                                               lm_weights=[1.0], interpolation=interpolation)
+            for type in ['moe', 'shallow', 'simple']:
+                scores, seqs = self.decoder.beam_search_with_language_model(
+                    mt_probs, gates, masks, short_list=6, beam_size=3, type=type)
+                ensemble_scores, ensemble_seqs = ensemble.beam_search_with_language_model(
+                    mt_probs, gates, masks, short_list=6, beam_size=3, type=type)
+                self.assertTrue(torch.equal(scores, ensemble_scores))
+                self.assertTrue(torch.equal(seqs, ensemble_seqs))
+            self.assertTrue(torch.equal(self.decoder.language_model_scores(targets, masks),
+                                        ensemble.language_model_scores(targets, masks)))
+
+    def test_linear_ensemble_weights(self):
+        # linear weights are normalized: a mixture of a model with itself scores as that model
+        mt_probs, gates, masks = self._random_batch(16)
+        targets = mt_probs.argmax(2)
+        ensemble = lm_decoder.KenLMDecoder(model_path=[self.model_path, self.model_path], vocab=self.vocab,
+                                           workers=4, lm_weights=[3.0, 1.0], interpolation='linear')
+        self.assertTrue(torch.allclose(self.decoder.language_model_scores(targets, masks),
+                                       ensemble.language_model_scores(targets, masks), atol=1e-4))
+        with self.assertRaises(ValueError):
+            lm_decoder.KenLMDecoder(model_path=[self.model_path, self.model_path], vocab=self.vocab,
+                                    lm_weights=[0.0, 0.0], interpolation='linear')
+
+    def test_binary_cache(self):
+        # the first load compiles the ARPA file into the cache, the second one loads that binary
+        if not self.model_path.endswith('.arpa'):
+            self.skipTest('needs an ARPA model')
+        mt_probs, gates, masks = self._random_batch(17)
+        targets = mt_probs.argmax(2)
+        cache_dir = tempfile.mkdtemp()
+        try:
+            for hit in [0, 1]:
+                decoder = lm_decoder.KenLMDecoder(model_path=self.model_path, vocab=self.vocab, workers=4,
+                                                  binary_cache_dir=cache_dir)
+                self.assertEqual(decoder.load_stats()['binary_cache_hit'], hit)
+                self.assertTrue(torch.equal(self.decoder.language_model_scores(targets, masks),
+                                            decoder.language_model_scores(targets, masks)))
+        finally:
+            shutil.rmtree(cache_dir)
+
+    def test_restrict_vocab(self):
+        # the restricted binary keeps every n-gram the vocabulary can reach: the same scores, fewer n-grams,
+        # and a hit reports the counts of the build
+        if not self.model_path.endswith('.arpa'):
+            self.skipTest('needs an ARPA model')
+        mt_probs, gates, masks = self._random_batch(19)
+        targets = mt_probs.argmax(2)
+        cache_dir = tempfile.mkdtemp()
+        try:
+            load_stats = []
+            for _ in range(2):
+                decoder = lm_decoder.KenLMDecoder(model_path=self.model_path, vocab=self.vocab, workers=4,
+                                                  binary_cache_dir=cache_dir, restrict_vocab=True)
+                self.assertTrue(torch.equal(self.decoder.language_model_scores(targets, masks),
+                                            decoder.language_model_scores(targets, masks)))
+                load_stats.append(decoder.load_stats())
+            self.assertEqual([stats['binary_cache_hit'] for stats in load_stats], [0, 1])
+            self.assertLess(load_stats[0]['kept_ngrams'], load_stats[0]['ngrams'])
+            for key in ['ngrams', 'kept_ngrams', 'model_bytes', 'kept_model_bytes']:
+                self.assertEqual(load_stats[0][key], load_stats[1][key])
+        finally:
+            shutil.rmtree(cache_dir)
+
+    def test_beam_session(self):
+        # the steps fed to a session in random chunks give the n-best of the search over all of them
+        mt_probs, gates, masks = self._random_batch(18)
+        batch, length = masks.size()
+        chunks = random.Random(18)
+        inside = masks.unsqueeze(2).long()
+        for type, prune_margin in [('moe', None), ('moe', 0), ('shallow', 0), ('simple', None)]:
+            scores, seqs = self.decoder.beam_search_with_language_model(
+                mt_probs, gates, masks, short_list=6, beam_size=3, type=type, prune_margin=prune_margin)
+            session = self.decoder.beam_session(beam_size=3, type=type, prune_margin=prune_margin)
+            session.init(batch)
+            begin = 0
+            while begin < length:
+                end = min(length, begin + chunks.randint(1, 4))
+                session.step(mt_probs[:, begin:end], gates[:, begin:end], masks[:, begin:end], short_list=6)
+                begin = end
+            session_scores, session_seqs = session.finalize()
+            self.assertTrue(torch.equal(scores, session_scores))
+            # past the end of a sentence the search leaves the candidates, the session zeros
+            self.assertTrue(torch.equal(seqs[:, :, :3] * inside, session_seqs * inside))
+
+    def test_beam_session_stats(self):
+        # finalize() for the n-best so far, then at the end: every sentence is counted once
+        mt_probs, gates, masks = self._random_batch(20)
+        decoder = lm_decoder.KenLMDecoder(model_path=self.model_path, vocab=self.vocab, workers=4, stats=True)
+        session = decoder.beam_session(beam_size=3)
+        session.init(masks.size(0))
+        session.step(mt_probs[:, :5], gates[:, :5], masks[:, :5], short_list=6)
+        session.finalize()
+        session.finalize()
+        session.step(mt_probs[:, 5:], gates[:, 5:], masks[:, 5:], short_list=6)
+        session.finalize()
+        stats = decoder.stats()
+        self.assertEqual(stats['sentences'], masks.size(0))
+        self.assertEqual(stats['tokens'], int(masks.sum()))
+        with self.assertRaises(ValueError):
+            decoder.beam_session(beam_size=0)
+
+    def test_incremental_scores(self):
+        # a few tokens and lengths change at every pass, the incremental scores must match a full rescoring
+        generator = torch.Generator().manual_seed(13)
+        batch, length = 16, 12
+        targets = torch.randint(2, len(self.vocab), (batch, length), generator=generator)
+        lengths = torch.randint(0, length + 1, (batch,), generator=generator)
+        lengths[0] = 0
+        incremental = self.decoder.incremental_scores()
+        for _ in range(6):
+            masks = self._masks(lengths, length)
+            self.assertTrue(torch.equal(incremental(targets, masks),
+                                        self.decoder.language_model_scores(targets, masks)))
+
+            edits = torch.randint(0, batch * length, (batch,), generator=generator)
+            targets.view(-1)[edits] = torch.randint(2, len(self.vocab), (batch,), generator=generator)
+            rows = torch.randint(0, batch, (3,), generator=generator)
+            lengths[rows] = torch.randint(0, length + 1, (3,), generator=generator)
+
+        stats = incremental.stats()
+        self.assertLess(stats['rescored'], stats['positions'])
+
+
 if __name__ == '__main__':
     unittest.main()